@@ -13,22 +13,45 @@
 // ================================================================================================
 
 //
-// c++ -std=c++14 -O2 -Wall -Wextra -pedantic vclpp_main.cpp -o vclpp
+// c++ -std=c++14 -O2 -Wall -Wextra -pedantic -pthread vclpp_main.cpp -o vclpp
 //
 #include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring> // added for linux support
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <iterator> // added for linux support
 
+// POSIX process spawning, for the driver mode:
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char ** environ;
+
 // ========================================================
 // Helpers:
 // ========================================================
@@ -44,6 +67,7 @@ struct MacroBlock
     std::string name;
     std::vector<std::string> params;
     std::vector<std::string> lines;
+    bool isOutlined = false; // '#macro outline', see resolveOutlinedCalls().
 };
 
 struct Directives
@@ -53,788 +77,4252 @@ struct Directives
     std::vector<MacroBlock>  macros;
 };
 
+// Location of a #define or #macro inside an #include file, recorded
+// by the lazy index scan. The actual directive is only parsed if used.
+struct IndexEntry
+{
+    std::string name;
+    std::size_t offset;   // Byte offset of the directive line in the file.
+    int         lineNum;  // For error reporting.
+    bool        isMacro;
+    bool        isLoaded;
+    Definition  define;   // Valid if loaded and !isMacro.
+    MacroBlock  macro;    // Valid if loaded and isMacro.
+};
+
 static inline bool isBlank(const std::string & s)
 {
     return s.find_first_not_of(" \n\r\t") == std::string::npos;
 }
 
+static inline bool isDefName(const std::string & s, long pos, long len);
+
 // ========================================================
-// class Preprocessor:
+// class ConstExprFolder:
 // ========================================================
 
-// Runs on a single file, building a list of includes, defines and macros.
-class Preprocessor final
+// Thrown on overflow, division by zero and other invalid constant expressions.
+struct ConstExprError final : public std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// Folds constant expressions involving literals, like the ones resulting
+// from #define replacement, e.g.: '(BASE + 2) * 4' => '(10 + 2) * 4' => '48'.
+//
+// Supports + - * / % << >> & | ^, parentheses and unary minus/plus
+// with the usual C precedence. Integers are decimal or hexadecimal
+// and evaluated with 64-bit precision. If either operand of an operator
+// is a float literal (e.g.: 1.5 or 2.0f) the result is also a float.
+//
+// For #if conditions, the comparison and logical operators
+// == != < > <= >= && || ! ~ are also accepted.
+class ConstExprFolder final
 {
 private:
 
-    //
-    // Miscellaneous:
-    //
+    struct Value
+    {
+        bool      isFloat;
+        long long i;
+        double    f;
+    };
 
-    // The file stream for the source (not the #includes).
-    std::ifstream sourceFile;
+    enum class TokenKind
+    {
+        Space,
+        Number,
+        Operator,
+        OpenParen,
+        CloseParen,
+        Other
+    };
 
-    // Lines of code that didn't make into directives/macros (blank lines ignored).
-    std::vector<std::string> codeLines;
+    struct Token
+    {
+        TokenKind   kind;
+        std::size_t start;
+        std::size_t length;
+        std::string op;    // Only set for TokenKind::Operator.
+        Value       value; // Only set for TokenKind::Number.
+        bool        isOutOfRange = false; // Number literal that doesn't fit, reported if evaluated.
+    };
 
-    // Whatever follows a #vuprog directive (source files only).
-    std::string vuProgName;
+    // The line being folded and its tokens (built in a single pass).
+    const std::string & text;
+    std::vector<Token> tokens;
 
-    // Used for error reporting only.
-    std::string currentFileName;
-    int currentLineNum;
-    bool isIncludeFile;
+    // Comparison/logical operators enabled?
+    const bool conditionals;
 
-    void error(const std::string & message) const
-    {
-        std::cerr << "ERROR: " << currentFileName
-                  << "(" << currentLineNum << "): "
-                  << message << std::endl;
+    // The parser runs twice for each expression: first just to validate
+    // it and find where it ends, then to actually compute the result. This
+    // way we don't report errors for things like '1/0*reg', which is not a
+    // constant expression and will not be folded anyway.
+    bool evaluating;
+    int  binaryOpCount;
 
-        throw std::runtime_error("Preprocessor error.");
+    static bool isIdentChar(const char c)
+    {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
     }
 
-    //
-    // Includes:
-    //
-    std::string readIncludeDirective(std::vector<std::string> & tokens) const
+    static bool isDigit(const char c)
     {
-        if (tokens[1].front() != '"' || tokens[1].back() != '"')
-        {
-            error("Include directive must be between double quotes and contain no spaces!");
-        }
-        return tokens[1].substr(1, tokens[1].length() - 2);
+        return std::isdigit(static_cast<unsigned char>(c)) != 0;
     }
 
-    //
-    // Defines:
-    //
-    Definition readDefineDirective(std::vector<std::string> & tokens) const
+    static int binaryPrecedence(const std::string & op)
     {
-        Definition def;
-        def.name = std::move(tokens[1]);
+        if (op == "*" || op == "/" || op == "%") { return 10; }
+        if (op == "+" || op == "-")              { return 9;  }
+        if (op == "<<" || op == ">>")            { return 8;  }
+        if (op == "&")                           { return 5;  }
+        if (op == "^")                           { return 4;  }
+        if (op == "<" || op == ">")              { return 7;  }
+        if (op == "<=" || op == ">=")            { return 7;  }
+        if (op == "==" || op == "!=")            { return 6;  }
+        if (op == "|")                           { return 3;  }
+        if (op == "&&")                          { return 2;  }
+        if (op == "||")                          { return 1;  }
+        return 0; // Not a binary operator.
+    }
 
-        // [0] = #define
-        // [1] = constant name
-        // [2..N] = value string
-        const auto numTokens = tokens.size();
-        for (std::size_t t = 2; t < numTokens; ++t)
-        {
-            def.value += tokens[t];
-            if (t != numTokens - 1)
-            {
-                def.value += " ";
-            }
-        }
+    static Value makeInt(const long long i)  { return { false, i, 0.0 }; }
+    static Value makeFloat(const double f)   { return { true, 0, f };    }
+    static double toDouble(const Value & v)  { return v.isFloat ? v.f : static_cast<double>(v.i); }
 
-        return def;
+    [[noreturn]] static void fail(const std::string & message)
+    {
+        throw ConstExprError{ message };
     }
 
     //
-    // Function-like macros:
+    // Tokenizer:
     //
-    MacroBlock readMacroHeader(std::vector<std::string> & tokens) const
+
+    static bool isTwoCharConditional(const char c, const char next)
     {
-        MacroBlock macro;
-        macro.name = std::move(tokens[1]);
+        return (next == '=' && (c == '=' || c == '!' || c == '<' || c == '>')) ||
+               (next == c   && (c == '&' || c == '|'));
+    }
 
-        // If the name is followed by a colon, no spaces in between, assume a parameter list.
-        if (macro.name.back() == ':')
-        {
-            // Get rid of the ':'
-            macro.name.pop_back();
+    bool lexNumber(std::size_t & pos, Value & value, bool & isOutOfRange) const
+    {
+        const char * begin = text.c_str() + pos;
+        char * end = nullptr;
+        errno = 0;
 
-            // [0] = #macro
-            // [1] = macro name
-            // [2..N] = comma separated parameter list
-            const auto numTokens = tokens.size();
-            for (std::size_t t = 2; t < numTokens; ++t)
+        if (begin[0] == '0' && (begin[1] == 'x' || begin[1] == 'X'))
+        {
+            if (!std::isxdigit(static_cast<unsigned char>(begin[2])))
             {
-                auto && param = std::move(tokens[t]);
-
-                // Just a lost comma from an editing error?
-                if (param == ",")
-                {
-                    error("Lost comma in macro '" + macro.name + "' parameter list!");
-                }
-
-                if (param.back() == ',')
-                {
-                    param.pop_back();
-                    if (t == numTokens - 1)
-                    {
-                        error("Extraneous comma after last macro parameter '" + param + "'!");
-                    }
-
-                    // A lost comma probably from editing out a previous parameter.
-                    if (param.back() == ',')
-                    {
-                        param.pop_back();
-                        error("Lost comma after macro parameter '" + param + "'!");
-                    }
-                }
-                else
-                {
-                    if (t != numTokens - 1)
-                    {
-                        error("Missing comma after macro parameter '" + param + "'!");
-                    }
-                }
-                macro.params.emplace_back(param);
+                return false;
             }
+            const unsigned long long u = std::strtoull(begin, &end, 16);
+            isOutOfRange = (errno == ERANGE || u > static_cast<unsigned long long>(LLONG_MAX));
+            value = makeInt(static_cast<long long>(u));
         }
         else
         {
-            if (tokens.size() > 2 && tokens[2][0] != ';')
+            // Decimal integer, unless followed by a fraction or exponent.
+            const char * p = begin;
+            while (isDigit(*p))
             {
-                error("More text follows macro declaration. "
-                      "Add a ':' right after the macro name to define a param list!");
+                ++p;
+            }
+            if (*p == '.' || *p == 'e' || *p == 'E')
+            {
+                const double f = std::strtod(begin, &end);
+                isOutOfRange = (errno == ERANGE);
+                if (*end == 'f' || *end == 'F')
+                {
+                    ++end;
+                }
+                value = makeFloat(f);
+            }
+            else
+            {
+                const unsigned long long u = std::strtoull(begin, &end, 10);
+                isOutOfRange = (errno == ERANGE || u > static_cast<unsigned long long>(LLONG_MAX));
+                value = makeInt(static_cast<long long>(u));
             }
         }
 
-        return macro;
-    }
-
-public:
-
-    const std::string & getVuProgName () const { return vuProgName;  }
-    const std::string & getCurrentFileName() const { return currentFileName;  }
-    const std::vector<std::string> & getCodeLines() const { return codeLines; }
-
-    Preprocessor(std::string filename, const bool isInclude)
-        : currentFileName { std::move(filename) }
-        , currentLineNum  { 0 }
-        , isIncludeFile   { isInclude }
-    {
-        sourceFile.exceptions(std::ifstream::goodbit); // Don't throw on error. We use error().
-        sourceFile.open(currentFileName);
-
-        if (!sourceFile.is_open() || !sourceFile.good())
+        // Something like '2x' is not a number.
+        if (end == begin || isIdentChar(*end))
         {
-            error("Unable to open file \"" + currentFileName + "\" for reading.");
+            return false;
         }
+
+        pos = end - text.c_str();
+        return true;
     }
 
-    Directives parseDirectives()
+    void tokenize()
     {
-        // Temps:
-        std::string line;
-        std::vector<std::string> tokens;
-
-        // #include directive filenames:
-        std::vector<std::string> includes;
-
-        // #define single-line constants:
-        std::vector<Definition> defines;
-
-        // #macro/#endmacro blocks:
-        bool insideMacro = false;
-        MacroBlock currentMacro;
-        std::vector<MacroBlock> macros;
-
-        // If the begin/end program sections are not found,
-        // we warn, but allow preprocessing to continue.
-        bool foundProgStart = false; // #vuprog
-        bool foundProgEnd   = false; // #endvuprog
+        const auto length = text.length();
+        std::size_t pos = 0;
 
-        //
-        // Main processing loop:
-        //
-        while (std::getline(sourceFile, line))
+        while (pos < length)
         {
-            ++currentLineNum;
+            const std::size_t start = pos;
+            const char c = text[pos];
 
-            if (isBlank(line))
+            Token tok{ TokenKind::Other, start, 0, {}, makeInt(0) };
+
+            if (c == ' ' || c == '\t' || c == '\r')
             {
-                continue;
+                while (pos < length && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r'))
+                {
+                    ++pos;
+                }
+                tok.kind = TokenKind::Space;
             }
-
-            // If inside a macro, add the contents to it.
-            if (insideMacro)
+            else if (isDigit(c) || (c == '.' && isDigit(text[pos + 1])))
             {
-                // Macro block closed.
-                if (line == "#endmacro")
+                if (lexNumber(pos, tok.value, tok.isOutOfRange))
                 {
-                    macros.emplace_back(std::move(currentMacro));
-                    insideMacro = false;
+                    tok.kind = TokenKind::Number;
                 }
                 else
                 {
-                    if (line[0] == '#')
+                    // Not a valid number; consume it as an ordinary word.
+                    pos = start + 1;
+                    while (pos < length && (isIdentChar(text[pos]) || text[pos] == '.'))
                     {
-                        error("Preprocessor directive inside macro block: '" + line + "'");
+                        ++pos;
                     }
-                    currentMacro.lines.emplace_back(std::move(line));
                 }
-                continue;
             }
-
-            // Not a define/macro and not resolving a macro block, ignore.
-            if (line[0] != '#')
+            else if (isIdentChar(c))
             {
-                if (line[0] != ';') // Don't bother adding pure comment lines.
+                while (pos < length && isIdentChar(text[pos]))
                 {
-                    codeLines.emplace_back(std::move(line));
+                    ++pos;
                 }
-                continue;
             }
-
-            // Split the line by whitespace:
-            std::istringstream tokenizer{ std::move(line) };
-            tokens.assign(std::istream_iterator<std::string>{ tokenizer },
-                          std::istream_iterator<std::string>{});
-
-            // Handle each preprocessor token:
-            if (tokens[0] == "#include")
+            else if (c == '(')
             {
-                includes.emplace_back(readIncludeDirective(tokens));
+                tok.kind = TokenKind::OpenParen;
+                ++pos;
             }
-            else if (tokens[0] == "#define")
+            else if (c == ')')
             {
-                defines.emplace_back(readDefineDirective(tokens));
+                tok.kind = TokenKind::CloseParen;
+                ++pos;
             }
-            else if (tokens[0] == "#macro")
+            else if ((c == '<' || c == '>') && text[pos + 1] == c)
             {
-                currentMacro = readMacroHeader(tokens);
-                insideMacro  = true;
+                tok.kind = TokenKind::Operator;
+                tok.op.assign(text, pos, 2);
+                pos += 2;
             }
-            else if (tokens[0] == "#vuprog")
+            else if (conditionals && isTwoCharConditional(c, text[pos + 1]))
             {
-                foundProgStart = true;
-                if (tokens.size() > 1)
-                {
-                    vuProgName = tokens[1];
-                }
+                tok.kind = TokenKind::Operator;
+                tok.op.assign(text, pos, 2);
+                pos += 2;
             }
-            else if (tokens[0] == "#endvuprog")
+            else if (std::strchr("+-*/%&|^", c) != nullptr ||
+                     (conditionals && std::strchr("<>!~", c) != nullptr))
             {
-                foundProgEnd = true;
+                tok.kind = TokenKind::Operator;
+                tok.op.assign(1, c);
+                ++pos;
             }
             else
             {
-                error("Unknown preprocessor directive '" + tokens[0] + "'!");
+                // Any other punctuation, including newlines, which
+                // separate the lines of an expanded macro.
+                ++pos;
             }
-        }
 
-        if (insideMacro)
-        {
-            error("End of file reached while parsing a macro directive! "
-                  "Last macro seen '" + currentMacro.name + "'.");
+            tok.length = pos - start;
+            tokens.emplace_back(std::move(tok));
         }
+    }
 
-        if (!isIncludeFile)
+    //
+    // Parser/evaluator:
+    //
+
+    std::size_t skipSpaces(std::size_t t) const
+    {
+        while (t < tokens.size() && tokens[t].kind == TokenKind::Space)
         {
-            if (!foundProgStart)
-            {
-                std::cout << "WARNING: Program start directive '#vuprog' was not found!\n";
-            }
-            if (!foundProgEnd)
-            {
-                std::cout << "WARNING: Program end directive '#endvuprog' was not found!\n";
-            }
+            ++t;
         }
-
-        return { std::move(includes), std::move(defines), std::move(macros) };
+        return t;
     }
-}; // class Preprocessor
-
-// ========================================================
-// split():
-// ========================================================
 
-static std::vector<std::string> split(const std::string & source, const char * delimiters)
-{
-    std::vector<std::string> tokenList;
-    if (!source.empty())
+    // Previous token ends an operand, so a following '-' or '+' is binary.
+    bool endsOperand(const std::size_t t) const
     {
-        // Need the local copy since strtok() will modify the input...
-        std::string tempString{ source };
-        char * tk = std::strtok(const_cast<char *>(tempString.c_str()), delimiters);
-        while (tk != nullptr)
+        const Token & tok = tokens[t];
+        if (tok.kind == TokenKind::Number || tok.kind == TokenKind::CloseParen)
         {
-            tokenList.emplace_back(tk);
-            tk = std::strtok(nullptr, delimiters);
+            return true;
         }
+        const char last = text[tok.start + tok.length - 1];
+        return tok.kind == TokenKind::Other && (isIdentChar(last) || last == ']');
     }
-    return tokenList;
-}
-
-// ========================================================
-// fixupConstExpressions():
-// ========================================================
 
-static void fixupConstExpressions(std::string & line)
-{
-    if (line.find_first_of("+-/*") == std::string::npos)
+    // Assembler convention: 'loi -2.5' is a sign, but 'vi01 - 1' and 'vi01-1' are a subtraction.
+    bool isSignPrefix(const std::size_t t) const
     {
-        return;
+        return t > 0 && tokens[t - 1].kind == TokenKind::Space &&
+               t + 1 < tokens.size() && tokens[t + 1].kind != TokenKind::Space;
     }
 
-    auto tokens = split(line, " \t");
-    std::string newLine;
-
-    //
-    // My ad hoc constant expression evaluation
-    // for basic arithmetical operators (+,-,/,*):
-    //
-    for (auto && tk : tokens)
+    Value applyUnaryMinus(const Value & v) const
     {
-        const auto opIndex = tk.find_first_of("+-/*");
-        if (opIndex == std::string::npos)
+        if (v.isFloat)
         {
-            newLine += tk; newLine += " ";
-            continue;
+            return makeFloat(-v.f);
         }
-
-        long start = opIndex - 1;
-        while (start > 0 &&
-               !std::isspace(tk[start]) && !std::ispunct(tk[start]))
+        if (v.i == LLONG_MIN)
         {
-            --start;
+            fail("integer overflow in unary minus");
         }
+        return makeInt(-v.i);
+    }
+
+    static bool isTrue(const Value & v)
+    {
+        return v.isFloat ? (v.f != 0.0) : (v.i != 0);
+    }
+
+    Value applyBinary(const std::string & op, const Value & a, const Value & b) const
+    {
+        if (op == "&&") { return makeInt(isTrue(a) && isTrue(b)); }
+        if (op == "||") { return makeInt(isTrue(a) || isTrue(b)); }
 
-        long end = opIndex + 1;
-        while (end < static_cast<long>(tk.length()) &&
-               !std::isspace(tk[end]) && !std::ispunct(tk[end]))
+        if (op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" || op == ">=")
         {
-            ++end;
-        }
+            const int cmp = (a.isFloat || b.isFloat)
+                          ? ((toDouble(a) < toDouble(b)) ? -1 : (toDouble(a) > toDouble(b)) ? 1 : 0)
+                          : ((a.i < b.i) ? -1 : (a.i > b.i) ? 1 : 0);
 
-        const auto strA = tk.substr(start, opIndex);
-        const auto strB = tk.substr(opIndex + 1, end - (opIndex + 1));
+            if (op == "==") { return makeInt(cmp == 0); }
+            if (op == "!=") { return makeInt(cmp != 0); }
+            if (op == "<")  { return makeInt(cmp <  0); }
+            if (op == ">")  { return makeInt(cmp >  0); }
+            if (op == "<=") { return makeInt(cmp <= 0); }
+            return makeInt(cmp >= 0);
+        }
 
-        if (!strA.empty() && !strB.empty())
+        if (a.isFloat || b.isFloat)
         {
-            long result = 0;
-            char * endPtr = nullptr;
+            const double x = toDouble(a);
+            const double y = toDouble(b);
+            double r = 0.0;
 
-            const long numA = std::strtol(strA.c_str(), &endPtr, 0);
-            if (endPtr == nullptr || endPtr == strA.c_str())
+            if      (op == "+") { r = x + y; }
+            else if (op == "-") { r = x - y; }
+            else if (op == "*") { r = x * y; }
+            else if (op == "/")
             {
-                newLine += tk; newLine += " ";
-                continue;
+                if (y == 0.0)
+                {
+                    fail("division by zero");
+                }
+                r = x / y;
             }
-
-            const long numB = std::strtol(strB.c_str(), &endPtr, 0);
-            if (endPtr == nullptr || endPtr == strB.c_str())
+            else
             {
-                newLine += tk; newLine += " ";
-                continue;
+                fail("operator '" + op + "' requires integer operands");
             }
 
-            switch (tk[opIndex])
+            if (!std::isfinite(r))
             {
-            case '+' : result = numA + numB; break;
-            case '-' : result = numA - numB; break;
-            case '/' : result = numA / numB; break;
-            case '*' : result = numA * numB; break;
-            default  : throw std::runtime_error("Unable to perform const expr resolution. Run again without '-x'");
-            } // switch (tk[opIndex])
+                fail("floating-point overflow in operator '" + op + "'");
+            }
+            return makeFloat(r);
+        }
+
+        const long long x = a.i;
+        const long long y = b.i;
+
+        if (op == "+")
+        {
+            if ((y > 0 && x > LLONG_MAX - y) || (y < 0 && x < LLONG_MIN - y))
+            {
+                fail("integer overflow in operator '+'");
+            }
+            return makeInt(x + y);
+        }
+        if (op == "-")
+        {
+            if ((y < 0 && x > LLONG_MAX + y) || (y > 0 && x < LLONG_MIN + y))
+            {
+                fail("integer overflow in operator '-'");
+            }
+            return makeInt(x - y);
+        }
+        if (op == "*")
+        {
+            const bool overflow = (x > 0) ? ((y > 0) ? x > LLONG_MAX / y : y < LLONG_MIN / x)
+                                          : ((y > 0) ? x < LLONG_MIN / y : (x != 0 && y < LLONG_MAX / x));
+            if (overflow)
+            {
+                fail("integer overflow in operator '*'");
+            }
+            return makeInt(x * y);
+        }
+        if (op == "/" || op == "%")
+        {
+            if (y == 0)
+            {
+                fail(op == "/" ? "division by zero" : "modulo by zero");
+            }
+            if (x == LLONG_MIN && y == -1)
+            {
+                fail("integer overflow in operator '" + op + "'");
+            }
+            return makeInt(op == "/" ? x / y : x % y);
+        }
+        if (op == "<<" || op == ">>")
+        {
+            if (y < 0 || y > 63)
+            {
+                fail("shift count out of range in operator '" + op + "'");
+            }
+            if (op == ">>")
+            {
+                return makeInt(x >> y);
+            }
+            if (x < 0 || x > (LLONG_MAX >> y))
+            {
+                fail("integer overflow in operator '<<'");
+            }
+            return makeInt(x << y);
+        }
+        if (op == "&") { return makeInt(x & y); }
+        if (op == "^") { return makeInt(x ^ y); }
+        if (op == "|") { return makeInt(x | y); }
+
+        fail("unknown operator '" + op + "'");
+    }
+
+    bool parseUnary(std::size_t & t, Value & result)
+    {
+        t = skipSpaces(t);
+        if (t >= tokens.size())
+        {
+            return false;
+        }
+
+        const Token & tok = tokens[t];
+        switch (tok.kind)
+        {
+        case TokenKind::Number :
+            if (tok.isOutOfRange && evaluating)
+            {
+                fail("Literal '" + text.substr(tok.start, tok.length) + "' is out of range");
+            }
+            result = tok.value;
+            ++t;
+            return true;
+
+        case TokenKind::OpenParen :
+            ++t;
+            if (!parseBinary(t, 1, result))
+            {
+                return false;
+            }
+            t = skipSpaces(t);
+            if (t >= tokens.size() || tokens[t].kind != TokenKind::CloseParen)
+            {
+                return false;
+            }
+            ++t;
+            return true;
+
+        case TokenKind::Operator :
+            if (tok.op == "-" || tok.op == "+")
+            {
+                const bool negate = (tok.op == "-");
+                ++t;
+                if (!parseUnary(t, result))
+                {
+                    return false;
+                }
+                if (negate && evaluating)
+                {
+                    result = applyUnaryMinus(result);
+                }
+                return true;
+            }
+            if (tok.op == "!" || tok.op == "~")
+            {
+                const bool logicalNot = (tok.op == "!");
+                ++t;
+                if (!parseUnary(t, result))
+                {
+                    return false;
+                }
+                if (evaluating)
+                {
+                    if (logicalNot)
+                    {
+                        result = makeInt(!isTrue(result));
+                    }
+                    else if (result.isFloat)
+                    {
+                        fail("operator '~' requires an integer operand");
+                    }
+                    else
+                    {
+                        result = makeInt(~result.i);
+                    }
+                }
+                return true;
+            }
+            return false;
+
+        default :
+            return false;
+        } // switch (tok.kind)
+    }
+
+    bool parseBinary(std::size_t & t, const int minPrecedence, Value & result)
+    {
+        if (!parseUnary(t, result))
+        {
+            return false;
+        }
+
+        for (;;)
+        {
+            const auto next = skipSpaces(t);
+            if (next >= tokens.size() || tokens[next].kind != TokenKind::Operator)
+            {
+                break;
+            }
+
+            const auto & op = tokens[next].op;
+            const int precedence = binaryPrecedence(op);
+            if (precedence == 0 || precedence < minPrecedence)
+            {
+                break;
+            }
+
+            std::size_t rhsPos = next + 1;
+            Value rhs;
+            if (!parseBinary(rhsPos, precedence + 1, rhs))
+            {
+                return false;
+            }
+
+            if (evaluating)
+            {
+                result = applyBinary(op, result, rhs);
+            }
+            ++binaryOpCount;
+            t = rhsPos;
+        }
+        return true;
+    }
+
+    // Tries to match a whole constant expression starting at token 't'.
+    // On success, 'end' is one past its last token.
+    bool matchExpression(const std::size_t t, std::size_t & end)
+    {
+        Value unused;
+        evaluating    = false;
+        binaryOpCount = 0;
+        end = t;
+
+        if (!parseBinary(end, 1, unused) || binaryOpCount == 0)
+        {
+            return false; // Not an expression, or just a lone literal.
+        }
+
+        // Must not be the prefix of a larger non-constant expression, like '2+3*reg'.
+        const auto next = skipSpaces(end);
+        return next >= tokens.size() || tokens[next].kind != TokenKind::Operator;
+    }
+
+    Value evaluateExpression(const std::size_t t, const std::size_t end)
+    {
+        Value result;
+        std::size_t pos = t;
+        evaluating = true;
+
+        try
+        {
+            parseBinary(pos, 1, result);
+        }
+        catch (const ConstExprError & e)
+        {
+            const auto & last = tokens[end - 1];
+            const auto exprText = text.substr(tokens[t].start, last.start + last.length - tokens[t].start);
+            fail("'" + exprText + "': " + e.what());
+        }
+        return result;
+    }
+
+    static std::string toString(const Value & v)
+    {
+        if (!v.isFloat)
+        {
+            return std::to_string(v.i);
+        }
+
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), "%.9g", v.f);
+
+        // Make sure it still reads as a float literal (e.g.: 2.0 and not 2).
+        std::string str{ buffer };
+        if (str.find_first_of(".eE") == std::string::npos)
+        {
+            str += ".0";
+        }
+        return str;
+    }
+
+public:
+
+    explicit ConstExprFolder(const std::string & line, const bool allowConditionals = false)
+        : text          { line  }
+        , conditionals  { allowConditionals }
+        , evaluating    { false }
+        , binaryOpCount { 0     }
+    {
+        tokenize();
+    }
+
+    // Evaluates the whole text as a single integer expression, e.g. for #if.
+    long long evaluateInteger()
+    {
+        Value unused;
+        std::size_t end = 0;
+        evaluating = false;
+
+        if (skipSpaces(0) == tokens.size())
+        {
+            fail("empty expression");
+        }
+        if (!parseBinary(end, 1, unused) || skipSpaces(end) != tokens.size())
+        {
+            fail("'" + text + "' is not a constant expression");
+        }
+
+        const auto result = evaluateExpression(0, end);
+        if (result.isFloat)
+        {
+            fail("'" + text + "' is not an integer expression");
+        }
+        return result.i;
+    }
+
+    // Returns a copy of the line with every constant expression replaced by its value.
+    std::string fold()
+    {
+        std::string result;
+        result.reserve(text.length());
+
+        // Index of the previous non-space token, if any.
+        std::size_t prev = tokens.size();
+
+        for (std::size_t t = 0; t < tokens.size();)
+        {
+            const Token & tok = tokens[t];
+            if (tok.kind == TokenKind::Space)
+            {
+                result.append(text, tok.start, tok.length);
+                ++t;
+                continue;
+            }
+
+            // An expression can't start right after an operator we didn't
+            // fold ('reg-1+2' or 'reg*2+3'), and a leading '-' or '+' after
+            // an operand is usually a binary operator, not a sign.
+            bool canStart = (tok.kind == TokenKind::Number || tok.kind == TokenKind::OpenParen ||
+                            (tok.kind == TokenKind::Operator && (tok.op == "-" || tok.op == "+")));
+            if (canStart && prev != tokens.size())
+            {
+                canStart = (tokens[prev].kind != TokenKind::Operator) &&
+                           (tok.kind != TokenKind::Operator || !endsOperand(prev) || isSignPrefix(t));
+            }
+
+            std::size_t end = 0;
+            if (canStart && matchExpression(t, end))
+            {
+                result += toString(evaluateExpression(t, end));
+                prev = end - 1;
+                t    = end;
+                continue;
+            }
+
+            result.append(text, tok.start, tok.length);
+            prev = t++;
+        }
+
+        return result;
+    }
+}; // class ConstExprFolder
+
+// ========================================================
+// class SourceCache:
+// ========================================================
+
+// A command-line/variant define that a file's conditionals looked up, and what was found.
+struct PredefineUse
+{
+    std::string name;
+    bool        isDefined;
+    std::string value;
+};
+
+// Directives of an #include file, and the predefines its parsing depended on.
+struct ParsedInclude
+{
+    Directives directives;
+    std::vector<PredefineUse> predefinesUsed;
+};
+
+// Contents of the source and #include files. Each file is only read
+// from disk once, even when preprocessed for several variants in parallel.
+// #include files are also only parsed once, unless their conditionals
+// look up defines that have different values in each variant.
+class SourceCache final
+{
+private:
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const std::string>> files;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<const ParsedInclude>>> parsedIncludes;
+
+    static bool matchesPredefines(const ParsedInclude & parsed, const std::vector<Definition> & predefines)
+    {
+        for (auto && use : parsed.predefinesUsed)
+        {
+            // The first definition of a name wins, as in Preprocessor::findPredefine().
+            const auto def = std::find_if(predefines.begin(), predefines.end(),
+                                          [&use](const Definition & d) { return d.name == use.name; });
+
+            const bool isDefined = (def != predefines.end());
+            if (isDefined != use.isDefined || (isDefined && def->value != use.value))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+
+    // Returns null if not parsed yet with the same values for the predefines it uses.
+    std::shared_ptr<const ParsedInclude> findParsedInclude(const std::string & filename,
+                                                           const std::vector<Definition> & predefines)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+
+        const auto iter = parsedIncludes.find(filename);
+        if (iter != parsedIncludes.end())
+        {
+            for (auto && parsed : iter->second)
+            {
+                if (matchesPredefines(*parsed, predefines))
+                {
+                    return parsed;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void addParsedInclude(const std::string & filename, std::shared_ptr<const ParsedInclude> parsed)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        parsedIncludes[filename].emplace_back(std::move(parsed));
+    }
+
+    // Returns null if the file can't be opened.
+    std::shared_ptr<const std::string> load(const std::string & filename)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+
+        const auto iter = files.find(filename);
+        if (iter != files.end())
+        {
+            return iter->second;
+        }
+
+        std::ifstream file;
+        file.exceptions(std::ifstream::goodbit); // Don't throw on error. Caller reports it.
+        file.open(filename);
+
+        if (!file.is_open() || !file.good())
+        {
+            return nullptr;
+        }
+
+        std::ostringstream contents;
+        contents << file.rdbuf();
+
+        auto text = std::make_shared<const std::string>(contents.str());
+        files.emplace(filename, text);
+        return text;
+    }
+}; // class SourceCache
+
+// ========================================================
+// class Preprocessor:
+// ========================================================
+
+// Runs on a single file, building a list of includes, defines and macros.
+class Preprocessor final
+{
+private:
+
+    //
+    // Miscellaneous:
+    //
+
+    // Contents of the whole file, loaded upfront. We read lines from
+    // memory so the lazy index can jump back to a directive's offset.
+    std::shared_ptr<const std::string> sourceText;
+    std::size_t readPos;
+
+    // #defines and #macros found by indexDirectives() (lazy mode only).
+    std::vector<IndexEntry> index;
+
+    // Command-line (-D) defines. Visible to the conditionals of every file.
+    // The ones looked up are recorded, since the parse only depends on those.
+    const std::vector<Definition> & predefines;
+    std::vector<PredefineUse> predefinesUsed;
+
+    // #included files (source file only). Each is opened when its #include
+    // line is reached, so that the conditionals and #repeat counts after it
+    // can use its #defines. In lazy mode they are only indexed.
+    SourceCache & sourceCache;
+    bool lazyIncludes;
+    std::vector<std::unique_ptr<Preprocessor>> includePPs;
+    std::vector<Directives> includeDirectives; // Not in lazy mode, shared via the SourceCache.
+    std::unordered_map<std::string, std::pair<std::size_t, std::size_t>> includedDefines; // [include, define/index entry]
+
+    // Lines of code that didn't make into directives/macros (blank lines ignored).
+    std::vector<std::string> codeLines;
+    std::vector<int> codeLineNums; // Source line of each, for the code size report.
+
+    // Whatever follows a #vuprog directive (source files only).
+    std::string vuProgName;
+
+    // Used for error reporting only.
+    std::string currentFileName;
+    int currentLineNum;
+    bool isIncludeFile;
+
+    void error(const std::string & message) const
+    {
+        std::cerr << "ERROR: " << currentFileName
+                  << "(" << currentLineNum << "): "
+                  << message << std::endl;
+
+        throw std::runtime_error("Preprocessor error.");
+    }
+
+    // Same as std::getline(), but from the in-memory file contents.
+    bool readLine(std::string & line)
+    {
+        if (readPos >= sourceText->length())
+        {
+            return false;
+        }
+
+        auto lineEnd = sourceText->find('\n', readPos);
+        if (lineEnd == std::string::npos)
+        {
+            lineEnd = sourceText->length();
+        }
+
+        line.assign(*sourceText, readPos, lineEnd - readPos);
+        readPos = lineEnd + 1;
+        return true;
+    }
+
+    void skipLine()
+    {
+        const auto lineEnd = sourceText->find('\n', readPos);
+        readPos = (lineEnd == std::string::npos) ? sourceText->length() : lineEnd + 1;
+    }
+
+    static void splitTokens(std::string line, std::vector<std::string> & tokens)
+    {
+        // Split the line by whitespace:
+        std::istringstream tokenizer{ std::move(line) };
+        tokens.assign(std::istream_iterator<std::string>{ tokenizer },
+                      std::istream_iterator<std::string>{});
+    }
+
+    //
+    // Includes:
+    //
+    std::string readIncludeDirective(std::vector<std::string> & tokens) const
+    {
+        if (tokens[1].front() != '"' || tokens[1].back() != '"')
+        {
+            error("Include directive must be between double quotes and contain no spaces!");
+        }
+        return tokens[1].substr(1, tokens[1].length() - 2);
+    }
+
+    void openInclude(const std::string & filename)
+    {
+        // If a name is defined more than once, the first one is what gets replaced in the code.
+        if (lazyIncludes)
+        {
+            const auto includeIndex = includePPs.size();
+            includePPs.emplace_back(std::make_unique<Preprocessor>(filename, true, predefines, sourceCache));
+
+            auto & pp = *includePPs.back();
+            pp.indexDirectives();
+
+            const auto & entries = pp.getIndex();
+            for (std::size_t e = 0; e < entries.size(); ++e)
+            {
+                if (!entries[e].isMacro)
+                {
+                    includedDefines.emplace(entries[e].name, std::make_pair(includeIndex, e));
+                }
+            }
+        }
+        else
+        {
+            // Other variants may have parsed it already.
+            auto parsed = sourceCache.findParsedInclude(filename, predefines);
+            if (parsed == nullptr)
+            {
+                Preprocessor pp{ filename, true, predefines, sourceCache };
+                auto newParsed = std::make_shared<ParsedInclude>();
+                newParsed->directives     = pp.parseDirectives();
+                newParsed->predefinesUsed = std::move(pp.predefinesUsed);
+
+                sourceCache.addParsedInclude(filename, newParsed);
+                parsed = std::move(newParsed);
+            }
+
+            const auto includeIndex = includeDirectives.size();
+            includeDirectives.emplace_back(parsed->directives);
+
+            const auto & defines = includeDirectives.back().defines;
+            for (std::size_t d = 0; d < defines.size(); ++d)
+            {
+                includedDefines.emplace(defines[d].name, std::make_pair(includeIndex, d));
+            }
+        }
+    }
+
+    const std::string * findIncludedDefine(const std::string & name)
+    {
+        const auto iter = includedDefines.find(name);
+        if (iter == includedDefines.end())
+        {
+            return nullptr;
+        }
+
+        const auto & ref = iter->second;
+        if (lazyIncludes)
+        {
+            return &includePPs[ref.first]->loadIndexEntry(ref.second).define.value;
+        }
+        return &includeDirectives[ref.first].defines[ref.second].value;
+    }
+
+    //
+    // Defines:
+    //
+    Definition readDefineDirective(std::vector<std::string> & tokens) const
+    {
+        Definition def;
+        def.name = std::move(tokens[1]);
+
+        // [0] = #define
+        // [1] = constant name
+        // [2..N] = value string, up to a ';' comment
+        const auto numTokens = tokens.size();
+        for (std::size_t t = 2; t < numTokens; ++t)
+        {
+            const auto comment = tokens[t].find(';');
+            if (comment != std::string::npos)
+            {
+                def.value.append(tokens[t], 0, comment);
+                break;
+            }
+
+            def.value += tokens[t];
+            if (t != numTokens - 1)
+            {
+                def.value += " ";
+            }
+        }
+
+        // Whatever space was left before the comment.
+        while (!def.value.empty() && def.value.back() == ' ')
+        {
+            def.value.pop_back();
+        }
+
+        return def;
+    }
+
+    //
+    // Conditional compilation:
+    //
+
+    // Returns the value of a #define visible at the current point, or null if undefined.
+    using DefineLookup = std::function<const std::string * (const std::string &)>;
+
+    struct ConditionalBlock
+    {
+        bool isActive; // Lines in the current branch are kept.
+        bool wasTaken; // A branch was already taken, or the enclosing block is inactive.
+        bool seenElse;
+        int  lineNum;
+    };
+
+    // #if/#ifdef/#ifndef blocks, innermost last.
+    std::vector<ConditionalBlock> conditionals;
+
+    bool isSkipping() const
+    {
+        return !conditionals.empty() && !conditionals.back().isActive;
+    }
+
+    const std::string * findPredefine(const std::string & name)
+    {
+        const auto def = std::find_if(predefines.begin(), predefines.end(),
+                                      [&name](const Definition & d) { return d.name == name; });
+
+        const bool isDefined = (def != predefines.end());
+        const bool seen = std::any_of(predefinesUsed.begin(), predefinesUsed.end(),
+                                      [&name](const PredefineUse & use) { return use.name == name; });
+        if (!seen)
+        {
+            predefinesUsed.push_back({ name, isDefined, isDefined ? def->value : std::string{} });
+        }
+
+        return isDefined ? &def->value : nullptr;
+    }
+
+    // Replaces 'defined NAME' or 'defined(NAME)' by 1 or 0 and every other
+    // name by its #define value, so ConstExprFolder can evaluate the result.
+    std::string expandExpressionNames(const std::string & expr, const DefineLookup & lookup,
+                                      const bool undefinedIsZero, const int depth = 0) const
+    {
+        if (depth > 32)
+        {
+            error("Recursive #define in expression '" + expr + "'!");
+        }
+
+        auto isNameChar = [](const char c)
+        {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        };
+        auto skipSpaces = [&expr](std::size_t pos)
+        {
+            while (pos < expr.length() && std::isspace(static_cast<unsigned char>(expr[pos])))
+            {
+                ++pos;
+            }
+            return pos;
+        };
+
+        std::string result;
+        std::size_t pos = 0;
+
+        while (pos < expr.length())
+        {
+            const char c = expr[pos];
+
+            // Numbers are copied as they are, including things like 0xFF and 1.5e3.
+            if (std::isdigit(static_cast<unsigned char>(c)))
+            {
+                const auto start = pos;
+                while (pos < expr.length() && (isNameChar(expr[pos]) || expr[pos] == '.'))
+                {
+                    ++pos;
+                }
+                result.append(expr, start, pos - start);
+                continue;
+            }
+
+            if (!isNameChar(c))
+            {
+                result += c;
+                ++pos;
+                continue;
+            }
+
+            const auto start = pos;
+            while (pos < expr.length() && isNameChar(expr[pos]))
+            {
+                ++pos;
+            }
+            const auto name = expr.substr(start, pos - start);
+
+            if (name == "defined")
+            {
+                pos = skipSpaces(pos);
+                const bool hasParens = (pos < expr.length() && expr[pos] == '(');
+                if (hasParens)
+                {
+                    pos = skipSpaces(pos + 1);
+                }
+
+                const auto nameStart = pos;
+                while (pos < expr.length() && isNameChar(expr[pos]))
+                {
+                    ++pos;
+                }
+                const auto nameEnd = pos;
+                if (nameStart == nameEnd)
+                {
+                    error("Missing name after 'defined' in expression '" + expr + "'!");
+                }
+
+                if (hasParens)
+                {
+                    pos = skipSpaces(pos);
+                    if (pos >= expr.length() || expr[pos] != ')')
+                    {
+                        error("Missing ')' after 'defined(' in expression '" + expr + "'!");
+                    }
+                    ++pos;
+                }
+
+                result += (lookup(expr.substr(nameStart, nameEnd - nameStart)) != nullptr) ? " 1 " : " 0 ";
+                continue;
+            }
+
+            if (const auto * value = lookup(name))
+            {
+                result += expandExpressionNames(*value, lookup, undefinedIsZero, depth + 1);
+            }
+            else if (undefinedIsZero)
+            {
+                result += "0"; // Same as C: undefined names in an #if are zero.
+            }
+            else
+            {
+                error("Undefined name '" + name + "' in expression '" + expr + "'!");
+            }
+        }
+
+        return result;
+    }
+
+    long long evaluateExpression(const std::string & expr, const std::string & context,
+                                 const DefineLookup & lookup, const bool undefinedIsZero) const
+    {
+        const auto expanded = expandExpressionNames(expr, lookup, undefinedIsZero);
+
+        long long value = 0;
+        try
+        {
+            value = ConstExprFolder{ expanded, true }.evaluateInteger();
+        }
+        catch (const ConstExprError & e)
+        {
+            error("Invalid " + context + " expression " + e.what());
+        }
+        return value;
+    }
+
+    bool evaluateCondition(const std::string & keyword, const std::string & line, const DefineLookup & lookup) const
+    {
+        // Whatever follows the keyword, minus comments.
+        auto expr = line.substr(keyword.length());
+        expr.erase(std::min(expr.find(';'), expr.length()));
+
+        if (isBlank(expr))
+        {
+            error("Missing expression after '" + keyword + "'!");
+        }
+
+        if (keyword == "#ifdef" || keyword == "#ifndef")
+        {
+            std::istringstream tokenizer{ expr };
+            std::string name, extra;
+            tokenizer >> name;
+
+            if (tokenizer >> extra)
+            {
+                error("More text follows '" + keyword + " " + name + "'!");
+            }
+            return (lookup(name) != nullptr) == (keyword == "#ifdef");
+        }
+
+        return evaluateExpression(expr, keyword, lookup, true) != 0;
+    }
+
+    // Handles #if/#ifdef/#ifndef/#elif/#else/#endif. Returns false for any other line.
+    // Blocks below 'outerDepth' belong to an enclosing #repeat and can't be closed here.
+    bool handleConditional(const std::string & line, const DefineLookup & lookup, const std::size_t outerDepth = 0)
+    {
+        const auto keyword = line.substr(0, line.find_first_of(" \t\r("));
+
+        if (keyword == "#if" || keyword == "#ifdef" || keyword == "#ifndef")
+        {
+            ConditionalBlock block{ false, true, false, currentLineNum };
+            if (!isSkipping())
+            {
+                block.isActive = evaluateCondition(keyword, line, lookup);
+                block.wasTaken = block.isActive;
+            }
+            conditionals.emplace_back(block);
+            return true;
+        }
+
+        if (keyword != "#elif" && keyword != "#else" && keyword != "#endif")
+        {
+            return false;
+        }
+
+        if (conditionals.size() <= outerDepth)
+        {
+            error("'" + keyword + "' without a matching #if!");
+        }
+
+        auto & block = conditionals.back();
+        if (keyword == "#endif")
+        {
+            conditionals.pop_back();
+        }
+        else if (block.seenElse)
+        {
+            error("'" + keyword + "' after #else!");
+        }
+        else if (keyword == "#else")
+        {
+            block.isActive = !block.wasTaken;
+            block.wasTaken = true;
+            block.seenElse = true;
+        }
+        else // #elif
+        {
+            block.isActive = !block.wasTaken && evaluateCondition(keyword, line, lookup);
+            block.wasTaken = block.wasTaken || block.isActive;
+        }
+        return true;
+    }
+
+    void checkConditionalsClosed()
+    {
+        if (!conditionals.empty())
+        {
+            currentLineNum = conditionals.back().lineNum;
+            error("End of file reached while parsing a conditional block! Missing #endif.");
+        }
+    }
+
+    //
+    // Repeat blocks:
+    //
+    struct RepeatBlock
+    {
+        long count;
+        std::string indexVar; // Optional, replaced by the iteration number (0 to count-1).
+        std::vector<std::string> lines;
+        std::vector<int> lineNums;
+        std::size_t conditionalDepth; // Conditional blocks open at the #repeat.
+    };
+
+    RepeatBlock readRepeatDirective(std::vector<std::string> & tokens, const DefineLookup & lookup) const
+    {
+        // [0] = #repeat
+        // [1] = repeat count (a constant expression with no spaces, can use #defines)
+        // [2] = optional index variable name
+        if (tokens.size() < 2)
+        {
+            error("Missing repeat count after #repeat!");
+        }
+        if (tokens.size() > 3 && tokens[3][0] != ';')
+        {
+            error("More text follows #repeat directive. Expected '#repeat <count> [index-var]'.");
+        }
+
+        const auto count = evaluateExpression(tokens[1], "#repeat count", lookup, false);
+        if (count < 0 || count > LONG_MAX)
+        {
+            error("Invalid #repeat count '" + tokens[1] + "'!");
+        }
+
+        RepeatBlock block;
+        block.count = static_cast<long>(count);
+        block.conditionalDepth = conditionals.size();
+        if (tokens.size() > 2 && tokens[2][0] != ';')
+        {
+            block.indexVar = std::move(tokens[2]);
+        }
+        return block;
+    }
+
+    static void expandRepeatBlock(const RepeatBlock & block, std::vector<std::string> & dest,
+                                  std::vector<int> & destLineNums, const bool isOutermost)
+    {
+        //
+        // Each line is split once around the uses of the index variable,
+        // so that every copy is then built by just appending the pieces
+        // and the iteration number, no searching or inserting in the middle.
+        // Nested blocks are expanded from the inside out, as each #endrepeat
+        // is found, so the outer block just sees a larger body.
+        //
+        // Like in C, '##' pastes the index to a neighbouring name: VF0##i => VF01
+        // The '##' markers are kept until the outermost block is expanded, so
+        // that an inner index doesn't glue itself to the outer one before it
+        // is replaced: VF##i##j => VF##i##1 => VF##0##1 => VF01
+        //
+        const auto & var = block.indexVar;
+        std::vector<std::vector<std::string>> lineTemplates;
+        lineTemplates.reserve(block.lines.size());
+
+        for (auto && line : block.lines)
+        {
+            std::vector<std::string> pieces;
+            std::size_t pieceStart = 0;
+
+            if (!var.empty())
+            {
+                auto pos = line.find(var);
+                while (pos != std::string::npos)
+                {
+                    if (isDefName(line, pos, var.length()))
+                    {
+                        pieces.emplace_back(line, pieceStart, pos - pieceStart);
+                        pieceStart = pos + var.length();
+                        pos = line.find(var, pieceStart);
+                    }
+                    else
+                    {
+                        pos = line.find(var, pos + 1);
+                    }
+                }
+            }
+
+            pieces.emplace_back(line, pieceStart, std::string::npos);
+
+            if (isOutermost)
+            {
+                for (auto && piece : pieces)
+                {
+                    for (auto pos = piece.find("##"); pos != std::string::npos; pos = piece.find("##", pos))
+                    {
+                        piece.erase(pos, 2);
+                    }
+                }
+            }
+            lineTemplates.emplace_back(std::move(pieces));
+        }
+
+        dest.reserve(dest.size() + block.count * block.lines.size());
+        destLineNums.reserve(destLineNums.size() + block.count * block.lines.size());
+
+        for (long i = 0; i < block.count; ++i)
+        {
+            const auto iteration = std::to_string(i);
+            for (auto && pieces : lineTemplates)
+            {
+                std::size_t length = pieces.size() * iteration.length();
+                for (auto && piece : pieces)
+                {
+                    length += piece.length();
+                }
+
+                std::string line;
+                line.reserve(length);
+
+                line += pieces[0];
+                for (std::size_t p = 1; p < pieces.size(); ++p)
+                {
+                    line += iteration;
+                    line += pieces[p];
+                }
+                dest.emplace_back(std::move(line));
+            }
+            destLineNums.insert(destLineNums.end(), block.lineNums.begin(), block.lineNums.end());
+        }
+    }
+
+    //
+    // Function-like macros:
+    //
+    static bool hasOutlineAttribute(const std::vector<std::string> & tokens)
+    {
+        // #macro outline Name: ...
+        return tokens.size() > 2 && tokens[1] == "outline" && tokens[2][0] != ';';
+    }
+
+    MacroBlock readMacroHeader(std::vector<std::string> & tokens) const
+    {
+        MacroBlock macro;
+        if (hasOutlineAttribute(tokens))
+        {
+            macro.isOutlined = true;
+            tokens.erase(tokens.begin() + 1);
+        }
+        macro.name = std::move(tokens[1]);
+
+        // If the name is followed by a colon, no spaces in between, assume a parameter list.
+        if (macro.name.back() == ':')
+        {
+            // Get rid of the ':'
+            macro.name.pop_back();
+
+            // [0] = #macro
+            // [1] = macro name
+            // [2..N] = comma separated parameter list
+            const auto numTokens = tokens.size();
+            for (std::size_t t = 2; t < numTokens; ++t)
+            {
+                auto && param = std::move(tokens[t]);
+
+                // Just a lost comma from an editing error?
+                if (param == ",")
+                {
+                    error("Lost comma in macro '" + macro.name + "' parameter list!");
+                }
+
+                if (param.back() == ',')
+                {
+                    param.pop_back();
+                    if (t == numTokens - 1)
+                    {
+                        error("Extraneous comma after last macro parameter '" + param + "'!");
+                    }
+
+                    // A lost comma probably from editing out a previous parameter.
+                    if (param.back() == ',')
+                    {
+                        param.pop_back();
+                        error("Lost comma after macro parameter '" + param + "'!");
+                    }
+                }
+                else
+                {
+                    if (t != numTokens - 1)
+                    {
+                        error("Missing comma after macro parameter '" + param + "'!");
+                    }
+                }
+                macro.params.emplace_back(param);
+            }
+        }
+        else
+        {
+            if (tokens.size() > 2 && tokens[2][0] != ';')
+            {
+                error("More text follows macro declaration. "
+                      "Add a ':' right after the macro name to define a param list!");
+            }
+        }
+
+        return macro;
+    }
+
+public:
+
+    const std::string & getVuProgName () const { return vuProgName;  }
+    const std::string & getCurrentFileName() const { return currentFileName;  }
+    const std::vector<std::string> & getCodeLines() const { return codeLines; }
+    const std::vector<int> & getCodeLineNums() const { return codeLineNums; }
+
+    // Opened by parseDirectives(), in the order of the #include directives.
+    std::vector<std::unique_ptr<Preprocessor>> & getIncludes() { return includePPs; }
+    std::vector<Directives> takeIncludeDirectives() { return std::move(includeDirectives); }
+
+    Preprocessor(std::string filename, const bool isInclude,
+                 const std::vector<Definition> & cmdLineDefines, SourceCache & cache,
+                 const bool lazyIncludeParsing = false)
+        : readPos         { 0 }
+        , predefines      { cmdLineDefines }
+        , sourceCache     { cache }
+        , lazyIncludes    { lazyIncludeParsing }
+        , currentFileName { std::move(filename) }
+        , currentLineNum  { 0 }
+        , isIncludeFile   { isInclude }
+    {
+        sourceText = sourceCache.load(currentFileName);
+        if (sourceText == nullptr)
+        {
+            error("Unable to open file \"" + currentFileName + "\" for reading.");
+        }
+    }
+
+    Directives parseDirectives()
+    {
+        // Temps:
+        std::string line;
+        std::vector<std::string> tokens;
+
+        // #include directive filenames:
+        std::vector<std::string> includes;
+
+        // #define single-line constants:
+        std::vector<Definition> defines;
+
+        // #defines seen so far, for conditionals and #repeat counts. The first
+        // definition of a name is the one that gets replaced in the code, and
+        // the ones from #includes come before the ones in the source file.
+        std::unordered_map<std::string, std::size_t> defineIndices;
+        const DefineLookup lookup = [&](const std::string & name) -> const std::string *
+        {
+            if (const auto * value = findPredefine(name))
+            {
+                return value;
+            }
+            if (const auto * value = findIncludedDefine(name))
+            {
+                return value;
+            }
+            const auto iter = defineIndices.find(name);
+            return (iter != defineIndices.end()) ? &defines[iter->second].value : nullptr;
+        };
+
+        // #macro/#endmacro blocks:
+        bool insideMacro = false;
+        MacroBlock currentMacro;
+        std::vector<MacroBlock> macros;
+
+        // #repeat/#endrepeat blocks, innermost last:
+        std::vector<RepeatBlock> repeatBlocks;
+
+        // If the begin/end program sections are not found,
+        // we warn, but allow preprocessing to continue.
+        bool foundProgStart = false; // #vuprog
+        bool foundProgEnd   = false; // #endvuprog
+
+        //
+        // Main processing loop:
+        //
+        while (readLine(line))
+        {
+            ++currentLineNum;
+
+            if (isBlank(line))
+            {
+                continue;
+            }
+
+            // If inside a macro, add the contents to it.
+            if (insideMacro)
+            {
+                // Macro block closed.
+                if (line == "#endmacro")
+                {
+                    macros.emplace_back(std::move(currentMacro));
+                    insideMacro = false;
+                }
+                else
+                {
+                    if (line[0] == '#')
+                    {
+                        error("Preprocessor directive inside macro block: '" + line + "'");
+                    }
+                    currentMacro.lines.emplace_back(std::move(line));
+                }
+                continue;
+            }
+
+            // Lines of a skipped #if/#else branch are discarded without further parsing.
+            if (line[0] == '#' && handleConditional(line, lookup, repeatBlocks.empty() ? 0 : repeatBlocks.back().conditionalDepth))
+            {
+                continue;
+            }
+            if (isSkipping())
+            {
+                continue;
+            }
+
+            // Not a define/macro and not resolving a macro block, ignore.
+            if (line[0] != '#')
+            {
+                if (line[0] != ';') // Don't bother adding pure comment lines.
+                {
+                    if (repeatBlocks.empty())
+                    {
+                        codeLines.emplace_back(std::move(line));
+                        codeLineNums.emplace_back(currentLineNum);
+                    }
+                    else
+                    {
+                        repeatBlocks.back().lines.emplace_back(std::move(line));
+                        repeatBlocks.back().lineNums.emplace_back(currentLineNum);
+                    }
+                }
+                continue;
+            }
+
+            splitTokens(std::move(line), tokens);
+
+            // Repeat blocks only take code and other repeat blocks.
+            if (tokens[0] == "#repeat")
+            {
+                repeatBlocks.emplace_back(readRepeatDirective(tokens, lookup));
+                continue;
+            }
+            if (tokens[0] == "#endrepeat")
+            {
+                if (repeatBlocks.empty())
+                {
+                    error("#endrepeat without a matching #repeat!");
+                }
+                if (repeatBlocks.back().conditionalDepth != conditionals.size())
+                {
+                    error("#endrepeat inside a conditional block that is not closed!");
+                }
+
+                const auto block = std::move(repeatBlocks.back());
+                repeatBlocks.pop_back();
+
+                if (!block.lines.empty())
+                {
+                    if (repeatBlocks.empty())
+                    {
+                        expandRepeatBlock(block, codeLines, codeLineNums, true);
+                    }
+                    else
+                    {
+                        expandRepeatBlock(block, repeatBlocks.back().lines, repeatBlocks.back().lineNums, false);
+                    }
+                }
+                continue;
+            }
+            if (!repeatBlocks.empty())
+            {
+                error("Preprocessor directive inside repeat block: '" + tokens[0] + "'");
+            }
+
+            // Handle each preprocessor token:
+            if (tokens[0] == "#include")
+            {
+                if (isIncludeFile)
+                {
+                    error("Include directives are not allowed inside #included files!");
+                }
+                includes.emplace_back(readIncludeDirective(tokens));
+                openInclude(includes.back());
+            }
+            else if (tokens[0] == "#define")
+            {
+                defines.emplace_back(readDefineDirective(tokens));
+                defineIndices.emplace(defines.back().name, defines.size() - 1);
+            }
+            else if (tokens[0] == "#macro")
+            {
+                currentMacro = readMacroHeader(tokens);
+                insideMacro  = true;
+            }
+            else if (tokens[0] == "#vuprog")
+            {
+                foundProgStart = true;
+                if (tokens.size() > 1)
+                {
+                    vuProgName = tokens[1];
+                }
+            }
+            else if (tokens[0] == "#endvuprog")
+            {
+                foundProgEnd = true;
+            }
+            else
+            {
+                error("Unknown preprocessor directive '" + tokens[0] + "'!");
+            }
+        }
+
+        if (insideMacro)
+        {
+            error("End of file reached while parsing a macro directive! "
+                  "Last macro seen '" + currentMacro.name + "'.");
+        }
+
+        if (!repeatBlocks.empty())
+        {
+            error("End of file reached while parsing a repeat directive! Missing #endrepeat.");
+        }
+
+        checkConditionalsClosed();
+
+        if (!isIncludeFile)
+        {
+            if (!foundProgStart)
+            {
+                std::cout << "WARNING: Program start directive '#vuprog' was not found!\n";
+            }
+            if (!foundProgEnd)
+            {
+                std::cout << "WARNING: Program end directive '#endvuprog' was not found!\n";
+            }
+        }
+
+        return { std::move(includes), std::move(defines), std::move(macros) };
+    }
+
+    //
+    // Lazy parsing (#include files only):
+    //
+
+    const std::vector<IndexEntry> & getIndex() const { return index; }
+
+    // Fast alternative to parseDirectives() that only records the name and
+    // location of each #define and #macro, skipping over the macro bodies.
+    // The entries are then parsed on demand with loadIndexEntry().
+    void indexDirectives()
+    {
+        std::string line;
+        std::vector<std::string> tokens;
+        bool insideMacro = false;
+        int  repeatDepth = 0;
+
+        // Conditionals need the value of the #defines they reference,
+        // so those entries get loaded right away.
+        std::unordered_map<std::string, std::size_t> defineIndices;
+        const DefineLookup lookup = [&](const std::string & name) -> const std::string *
+        {
+            if (const auto * value = findPredefine(name))
+            {
+                return value;
+            }
+            const auto iter = defineIndices.find(name);
+            if (iter == defineIndices.end())
+            {
+                return nullptr;
+            }
+
+            const auto savedReadPos = readPos;
+            const auto savedLineNum = currentLineNum;
+            const auto & entry = loadIndexEntry(iter->second);
+            readPos        = savedReadPos;
+            currentLineNum = savedLineNum;
+            return &entry.define.value;
+        };
+
+        while (readPos < sourceText->length())
+        {
+            const auto lineStart = readPos;
+            ++currentLineNum;
+
+            // Code and macro body lines: skip without even copying them.
+            if ((*sourceText)[lineStart] != '#')
+            {
+                skipLine();
+                continue;
+            }
+
+            readLine(line);
+
+            if (insideMacro)
+            {
+                if (line == "#endmacro")
+                {
+                    insideMacro = false;
+                }
+                else
+                {
+                    error("Preprocessor directive inside macro block: '" + line + "'");
+                }
+                continue;
+            }
+
+            if (handleConditional(line, lookup) || isSkipping())
+            {
+                continue;
+            }
+
+            splitTokens(std::move(line), tokens);
+
+            if (tokens[0] == "#repeat")
+            {
+                ++repeatDepth;
+            }
+            else if (tokens[0] == "#endrepeat")
+            {
+                if (--repeatDepth < 0)
+                {
+                    error("#endrepeat without a matching #repeat!");
+                }
+            }
+            else if (repeatDepth > 0)
+            {
+                error("Preprocessor directive inside repeat block: '" + tokens[0] + "'");
+            }
+            else if (tokens[0] == "#define" || tokens[0] == "#macro")
+            {
+                if (tokens.size() < 2)
+                {
+                    error("Missing name after '" + tokens[0] + "' directive!");
+                }
+
+                if (tokens[0] == "#macro" && hasOutlineAttribute(tokens))
+                {
+                    tokens.erase(tokens.begin() + 1);
+                }
+
+                IndexEntry entry{ std::move(tokens[1]), lineStart, currentLineNum, false, false, {}, {} };
+                if (tokens[0] == "#macro")
+                {
+                    if (entry.name.back() == ':')
+                    {
+                        entry.name.pop_back();
+                    }
+                    entry.isMacro = true;
+                    insideMacro   = true;
+                }
+                else
+                {
+                    defineIndices.emplace(entry.name, index.size());
+                }
+                index.emplace_back(std::move(entry));
+            }
+            else if (tokens[0] == "#include")
+            {
+                error("Include directives are not allowed inside #included files!");
+            }
+            else if (tokens[0] != "#vuprog" && tokens[0] != "#endvuprog")
+            {
+                error("Unknown preprocessor directive '" + tokens[0] + "'!");
+            }
+        }
+
+        if (insideMacro)
+        {
+            error("End of file reached while parsing a macro directive! "
+                  "Last macro seen '" + index.back().name + "'.");
+        }
+
+        if (repeatDepth != 0)
+        {
+            error("End of file reached while parsing a repeat directive! Missing #endrepeat.");
+        }
+
+        checkConditionalsClosed();
+    }
+
+    // Parses the full #define or #macro for the given index entry, if not already loaded.
+    const IndexEntry & loadIndexEntry(const std::size_t entryIndex)
+    {
+        auto & entry = index[entryIndex];
+        if (entry.isLoaded)
+        {
+            return entry;
+        }
+
+        std::string line;
+        std::vector<std::string> tokens;
+
+        readPos        = entry.offset;
+        currentLineNum = entry.lineNum;
+        readLine(line);
+        splitTokens(std::move(line), tokens);
+
+        if (entry.isMacro)
+        {
+            entry.macro = readMacroHeader(tokens);
+
+            // The index scan already validated the block, so just read up to #endmacro.
+            while (readLine(line))
+            {
+                ++currentLineNum;
+                if (isBlank(line))
+                {
+                    continue;
+                }
+                if (line == "#endmacro")
+                {
+                    break;
+                }
+                entry.macro.lines.emplace_back(std::move(line));
+            }
+        }
+        else
+        {
+            entry.define = readDefineDirective(tokens);
+        }
+
+        entry.isLoaded = true;
+        return entry;
+    }
+
+    // Directives for all the loaded entries, in the order they appear in the file.
+    Directives takeLoadedDirectives()
+    {
+        Directives dir;
+        for (auto && entry : index)
+        {
+            if (!entry.isLoaded)
+            {
+                continue;
+            }
+            if (entry.isMacro)
+            {
+                dir.macros.emplace_back(std::move(entry.macro));
+            }
+            else
+            {
+                dir.defines.emplace_back(std::move(entry.define));
+            }
+        }
+        index.clear();
+        return dir;
+    }
+}; // class Preprocessor
+
+// ========================================================
+// fixupConstExpressions():
+// ========================================================
+
+static void fixupConstExpressions(std::string & line)
+{
+    // Quick rejection test, most lines have no operators at all.
+    if (line.find_first_of("+-*/%<>&|^") == std::string::npos)
+    {
+        return;
+    }
+
+    try
+    {
+        line = ConstExprFolder{ line }.fold();
+    }
+    catch (const ConstExprError & e)
+    {
+        std::cerr << "ERROR: Constant expression " << e.what() << " in line: '" << line << "'" << std::endl;
+        throw std::runtime_error("Unable to perform const expr resolution. Run again without '-x'");
+    }
+}
+
+// ========================================================
+// isDefName()/isMacroName():
+// ========================================================
+
+static inline bool isDefName(const std::string & s, const long pos, const long len)
+{
+    //
+    // A macro/define name referenced in the text/code must
+    // be either surrounded by whitespace or punctuation.
+    //
+    // E.g.: func(FOO+42);
+    // Where 'FOO' is a #define constant.
+    //
+    // This checking is necessary to avoid replacing
+    // accidental things like in a "FOOBAR" string.
+    //
+
+    const long prevChar = pos - 1;
+    const long postChar = pos + len;
+
+    // At the left end
+    if (prevChar < 0)
+    {
+        return (postChar >= static_cast<long>(s.length())) ||
+               (std::isspace(s[postChar]) || std::ispunct(s[postChar]));
+    }
+    // At the right end
+    if (postChar >= static_cast<long>(s.length()))
+    {
+        return std::isspace(s[prevChar]) || std::ispunct(s[prevChar]);
+    }
+    // In the middle
+    return (std::isspace(s[prevChar]) || std::ispunct(s[prevChar])) &&
+           (std::isspace(s[postChar]) || std::ispunct(s[postChar]));
+}
+
+static inline bool isMacroName(const std::string & s, const long pos, const long len)
+{
+    const long prevChar = pos - 1;
+    const long postChar = pos + len;
+
+    // At the left end
+    if (prevChar < 0)
+    {
+        // Must have a '{' to the right-hand side
+        return postChar < static_cast<long>(s.length()) && s[postChar] == '{';
+    }
+    // At the right end
+    if (postChar >= static_cast<long>(s.length()))
+    {
+        // Missing the '{'?
+        return false;
+    }
+    // In the middle
+    return (std::isspace(s[prevChar]) || std::ispunct(s[prevChar])) && (s[postChar] == '{');
+}
+
+// ========================================================
+// doReplaceDefs():
+// ========================================================
+
+// Returns true if anything was replaced.
+static inline bool doReplaceDefs(std::string & line, const std::string & search, const std::string & replace)
+{
+    bool replaced = false;
+    for (std::size_t pos = 0; ; pos += replace.length())
+    {
+        if ((pos = line.find(search, pos)) == std::string::npos)
+        {
+            break;
+        }
+        if (isDefName(line, pos, search.length()))
+        {
+            line.erase(pos, search.length());
+            line.insert(pos, replace);
+            replaced = true;
+        }
+    }
+    return replaced;
+}
+
+// ========================================================
+// runInParallel()/splitIntoChunks():
+// ========================================================
+
+// Runs task(0) to task(numTasks-1) on up to numThreads threads, the calling
+// thread included. If any task throws, the first exception is rethrown once
+// all tasks are done.
+static void runInParallel(const std::size_t numTasks, const unsigned numThreads,
+                          const std::function<void(std::size_t)> & task)
+{
+    std::atomic<std::size_t> nextTask{ 0 };
+    std::exception_ptr firstError;
+    std::mutex errorMutex;
+
+    auto worker = [&]()
+    {
+        for (auto t = nextTask++; t < numTasks; t = nextTask++)
+        {
+            try
+            {
+                task(t);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock{ errorMutex };
+                if (firstError == nullptr)
+                {
+                    firstError = std::current_exception();
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t t = 1; t < std::min<std::size_t>(numThreads, numTasks); ++t)
+    {
+        threads.emplace_back(worker);
+    }
+    worker(); // Main thread helps too.
+
+    for (auto && thread : threads)
+    {
+        thread.join();
+    }
+
+    if (firstError != nullptr)
+    {
+        std::rethrow_exception(firstError);
+    }
+}
+
+// Below this many lines it's not worth spawning threads.
+static constexpr std::size_t ParallelMinLines = 4096;
+
+// [begin, end) ranges of lines, one per parallel task.
+static std::vector<std::pair<std::size_t, std::size_t>> splitIntoChunks(const std::size_t numLines,
+                                                                        const unsigned numThreads)
+{
+    if (numThreads <= 1 || numLines < ParallelMinLines)
+    {
+        return { { 0, numLines } };
+    }
+
+    // A few chunks per thread, so that one with lots of
+    // macro invocations doesn't hold up everybody else.
+    const auto numChunks = std::min<std::size_t>(numThreads * 4, numLines / (ParallelMinLines / 4));
+    const auto chunkSize = (numLines + numChunks - 1) / numChunks;
+
+    std::vector<std::pair<std::size_t, std::size_t>> chunks;
+    for (std::size_t begin = 0; begin < numLines; begin += chunkSize)
+    {
+        chunks.emplace_back(begin, std::min(begin + chunkSize, numLines));
+    }
+    return chunks;
+}
+
+// ========================================================
+// resolveDefines():
+// ========================================================
+
+static void resolveDefinesRange(const std::vector<std::string> & codeLines,
+                                const std::size_t begin, const std::size_t end,
+                                const std::vector<Directives> & directives,
+                                std::vector<std::string> & expandedDefs,
+                                std::vector<std::vector<std::uint32_t>> * definesUsed)
+{
+    for (auto i = begin; i < end; ++i)
+    {
+        auto line = codeLines[i];
+        std::uint32_t defIndex = 0;
+        for (const auto & dir : directives)
+        {
+            for (const auto & def : dir.defines)
+            {
+                if (doReplaceDefs(line, def.name, def.value) && definesUsed != nullptr)
+                {
+                    (*definesUsed)[i].push_back(defIndex);
+                }
+                ++defIndex;
+            }
+        }
+        expandedDefs[i] = std::move(line);
+    }
+}
+
+static std::vector<std::string> resolveDefines(const std::vector<std::string> & codeLines,
+                                               const std::vector<Directives>  & directives,
+                                               std::vector<std::vector<std::uint32_t>> * definesUsed = nullptr,
+                                               const unsigned numThreads = 1)
+{
+    std::vector<std::string> expandedDefs(codeLines.size());
+
+    // Optionally records which #defines replaced something in each line, counting
+    // them in the order of the directives, across all files.
+    if (definesUsed != nullptr)
+    {
+        definesUsed->assign(codeLines.size(), {});
+    }
+
+    // We have to test each line of the source with each #define
+    // found inside the source file plus all of its #includes, so
+    // you can imagine this triple looping is not very scalable.
+    // Luckily our inputs are small, so this rudimentary text
+    // replacement still performs reasonably well. Lines are
+    // independent, so large inputs are split between threads.
+    const auto chunks = splitIntoChunks(codeLines.size(), numThreads);
+
+    runInParallel(chunks.size(), numThreads, [&](const std::size_t c)
+    {
+        resolveDefinesRange(codeLines, chunks[c].first, chunks[c].second, directives, expandedDefs, definesUsed);
+    });
+
+    return expandedDefs;
+}
+
+// ========================================================
+// doMacroExpansion():
+// ========================================================
+
+static void doMacroExpansion(std::string & line, const MacroBlock & macro)
+{
+    if (macro.lines.empty())
+    {
+        line.clear();
+        return;
+    }
+
+    // Split the line by whitespace to get the macro params:
+    std::istringstream tokenizer{ line };
+    std::vector<std::string> params{ std::istream_iterator<std::string>{ tokenizer },
+                                     std::istream_iterator<std::string>{} };
+
+    // Do minimal parameter validation:
+    if (!macro.params.empty())
+    {
+        if ((params.size() - 2) != macro.params.size())
+        {
+            std::cerr << "ERROR: Macro '" << macro.name << "' takes "
+                      << macro.params.size() << " arguments, but "
+                      << (params.size() - 2) << " were provided!" << std::endl;
+
+            throw std::runtime_error("Not enough arguments in macro invocation.");
+        }
+    }
+    else
+    {
+        if (params.size() > 2)
+        {
+            std::cerr << "ERROR: Macro '" << macro.name << "' takes no arguments, but "
+                      << (params.size() - 2) << " were provided!" << std::endl;
+
+            throw std::runtime_error("Too many arguments in macro invocation.");
+        }
+    }
+
+    // Replace the parameters, if any:
+    auto macroBody = macro.lines;
+    if (!macro.params.empty())
+    {
+        auto stripCommas = [](std::string & s) -> std::string &
+        {
+            if (s.back()  == ',') { s.pop_back();    }
+            if (s.front() == ',') { s = s.substr(1); }
+            return s;
+        };
+
+        for (auto & l : macroBody)
+        {
+            for (std::size_t p = 0; p < macro.params.size(); ++p)
+            {
+                doReplaceDefs(l, macro.params[p], stripCommas(params[p + 1]));
+            }
+        }
+    }
+
+    // Expand the macro body into the out:
+    line = "\n";
+    for (auto && l : macroBody)
+    {
+        line += l;
+        line += "\n";
+    }
+}
+
+// ========================================================
+// getMacroArgs():
+// ========================================================
+
+// Arguments of a macro invocation like 'Name{ a, b, c }', without the commas.
+static std::vector<std::string> getMacroArgs(const std::string & line)
+{
+    std::istringstream tokenizer{ line };
+    std::vector<std::string> tokens{ std::istream_iterator<std::string>{ tokenizer },
+                                     std::istream_iterator<std::string>{} };
+
+    // [0] = Name{
+    // [1..N-1] = arguments
+    // [N] = }
+    std::vector<std::string> args;
+    for (std::size_t t = 1; t + 1 < tokens.size(); ++t)
+    {
+        auto arg = std::move(tokens[t]);
+        if (!arg.empty() && arg.back()  == ',') { arg.pop_back(); }
+        if (!arg.empty() && arg.front() == ',') { arg.erase(0, 1); }
+        args.emplace_back(std::move(arg));
+    }
+    return args;
+}
+
+// ========================================================
+// class MacroExpansionCache:
+// ========================================================
+
+// Memoizes doMacroExpansion() by macro and argument list. Generated and
+// unrolled code invokes the same macro with the same arguments over and
+// over, so most expansions become a lookup plus a copy of the text.
+class MacroExpansionCache final
+{
+private:
+
+    // Argument list => expanded text, per macro.
+    std::unordered_map<const MacroBlock *, std::unordered_map<std::string, std::string>> expansions;
+
+    std::size_t hits;
+    std::size_t misses;
+
+public:
+
+    MacroExpansionCache()
+        : hits   { 0 }
+        , misses { 0 }
+    { }
+
+    std::size_t getHits()   const { return hits;   }
+    std::size_t getMisses() const { return misses; }
+
+    void addStats(const MacroExpansionCache & other)
+    {
+        hits   += other.hits;
+        misses += other.misses;
+    }
+
+    // Same as doMacroExpansion(line, macro).
+    void expand(std::string & line, const MacroBlock & macro)
+    {
+        // Arguments are whitespace separated, so a newline can't be part of one.
+        std::string key;
+        for (auto && arg : getMacroArgs(line))
+        {
+            key += arg;
+            key += '\n';
+        }
+
+        auto & macroExpansions = expansions[&macro];
+        const auto iter = macroExpansions.find(key);
+        if (iter != macroExpansions.end())
+        {
+            line.assign(iter->second);
+            ++hits;
+            return;
+        }
+
+        // Errors are not cached, they throw every time.
+        doMacroExpansion(line, macro);
+        macroExpansions.emplace(std::move(key), line);
+        ++misses;
+    }
+
+    std::string formatStats() const
+    {
+        const auto total = hits + misses;
+        char buffer[128];
+        std::snprintf(buffer, sizeof(buffer),
+                      "Macro expansion cache: %zu hits, %zu misses (%.1f%% hit rate).\n",
+                      hits, misses, (total > 0) ? (100.0 * hits / total) : 0.0);
+        return buffer;
+    }
+}; // class MacroExpansionCache
+
+// ========================================================
+// resolveOutlinedCalls():
+// ========================================================
+
+// Register that holds the return address of outlined macro calls. It's
+// left out of the '.init_vi' list of the VCL prologue, so VCL won't use it.
+static const char OutlineLinkReg[] = "vi15";
+
+struct OutlinedCall
+{
+    std::size_t lineIndex;
+    const MacroBlock * macro;
+};
+
+// True if the text has the (lowercase) register name as a whole word, in any case, outside of ';' comments.
+static bool hasRegisterName(std::string text, const std::string & reg)
+{
+    std::transform(text.begin(), text.end(), text.begin(),
+                   [](const char ch) { return static_cast<char>(std::tolower(static_cast<unsigned char>(ch))); });
+
+    // An expanded macro has several lines, each with its own comment.
+    for (auto pos = text.find(';'); pos != std::string::npos; pos = text.find(';', pos))
+    {
+        const auto lineEnd = text.find('\n', pos);
+        text.erase(pos, (lineEnd == std::string::npos) ? std::string::npos : lineEnd - pos);
+    }
+
+    auto isNameChar = [](const char ch) { return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_'; };
+    for (auto pos = text.find(reg); pos != std::string::npos; pos = text.find(reg, pos + 1))
+    {
+        const auto end = pos + reg.length();
+        if ((pos == 0 || !isNameChar(text[pos - 1])) && (end == text.length() || !isNameChar(text[end])))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Same, after #define replacement. Only used for errors, so it doesn't matter that it's not very fast.
+static bool usesRegister(std::string text, const std::string & reg, const std::vector<Directives> & directives)
+{
+    for (const auto & dir : directives)
+    {
+        for (const auto & def : dir.defines)
+        {
+            doReplaceDefs(text, def.name, def.value);
+        }
+    }
+    return hasRegisterName(std::move(text), reg);
+}
+
+static void resolveOutlinedCalls(std::vector<std::string> & expandedMacros,
+                                 const std::vector<OutlinedCall> & calls,
+                                 const std::vector<Directives> & directives,
+                                 MacroExpansionCache & expansionCache,
+                                 std::vector<const MacroBlock *> * macroOrigins)
+{
+    //
+    // Calls to an outlined macro that repeat the same arguments share a single
+    // copy of the expanded body, emitted as a subroutine after the program:
+    //
+    //   bal vi15, __outline_Name_0   ; At each call site.
+    //   ...
+    //   __outline_Name_0:            ; Once, at the end.
+    //     <macro body>
+    //     jr vi15
+    //
+    // Since the parameters are replaced in the text, calls with different
+    // arguments need their own copy. A call with a unique set of arguments
+    // gains nothing from it, so it's just inlined as usual. VCL takes care
+    // of the branch delay slots.
+    //
+    std::vector<std::string> callKeys;
+    std::unordered_map<std::string, int> callCounts;
+
+    callKeys.reserve(calls.size());
+    for (auto && call : calls)
+    {
+        std::string key = call.macro->name + "{";
+        for (auto && arg : getMacroArgs(expandedMacros[call.lineIndex]))
+        {
+            key += arg;
+            key += ",";
+        }
+        callCounts[key]++;
+        callKeys.emplace_back(std::move(key));
+    }
+
+    std::unordered_map<std::string, std::string> subroutineLabels;
+    std::unordered_map<std::string, int> subroutinesPerMacro;
+    std::vector<std::pair<const MacroBlock *, std::string>> subroutines;
+
+    for (std::size_t c = 0; c < calls.size(); ++c)
+    {
+        const auto & macro = *calls[c].macro;
+        auto & line = expandedMacros[calls[c].lineIndex];
+
+        if (callCounts[callKeys[c]] < 2 || macro.lines.empty())
+        {
+            expansionCache.expand(line, macro);
+            continue;
+        }
+
+        auto & label = subroutineLabels[callKeys[c]];
+        if (label.empty())
+        {
+            label = "__outline_" + macro.name + "_" + std::to_string(subroutinesPerMacro[macro.name]++);
+
+            std::string body{ line };
+            expansionCache.expand(body, macro);
+
+            // The #defines are only replaced later, but could also name the register.
+            if (usesRegister(body, OutlineLinkReg, directives))
+            {
+                std::cerr << "ERROR: Outlined macro '" << macro.name << "' uses " << OutlineLinkReg
+                          << ", which holds the subroutine return address!" << std::endl;
+
+                throw std::runtime_error("Link register used in outlined macro.");
+            }
+
+            subroutines.emplace_back(&macro, "\n" + label + ":" + body + "    jr " + OutlineLinkReg + "\n");
+        }
+
+        line = std::string{ "    bal " } + OutlineLinkReg + ", " + label;
+    }
+
+    if (subroutines.empty())
+    {
+        return;
+    }
+
+    // Jump over the subroutines in case the program falls through to the end.
+    expandedMacros.emplace_back("    b __outline_end");
+    if (macroOrigins != nullptr)
+    {
+        macroOrigins->emplace_back(nullptr);
+    }
+
+    for (auto && sub : subroutines)
+    {
+        expandedMacros.emplace_back(std::move(sub.second));
+        if (macroOrigins != nullptr)
+        {
+            macroOrigins->emplace_back(sub.first);
+        }
+    }
+
+    expandedMacros.emplace_back("__outline_end:");
+    if (macroOrigins != nullptr)
+    {
+        macroOrigins->emplace_back(nullptr);
+    }
+}
+
+// Once a program calls outlined subroutines, vi15 holds their return address, so
+// the rest of the code can't keep anything there either: the next 'bal' would
+// overwrite it. Takes the output of resolveDefines(), with the subroutines at the end.
+static void checkLinkRegisterUnused(const std::vector<std::string> & lines,
+                                    const std::vector<std::size_t> & codeLineIndexes,
+                                    const std::vector<int> & codeLineNums,
+                                    const std::string & fileName)
+{
+    // The subroutine bodies were already checked by resolveOutlinedCalls().
+    const std::string callPrefix = std::string{ "    bal " } + OutlineLinkReg + ", __outline_";
+
+    for (std::size_t i = 0; i < codeLineIndexes.size(); ++i)
+    {
+        if (lines[i].compare(0, callPrefix.length(), callPrefix) == 0)
+        {
+            continue;
+        }
+        if (hasRegisterName(lines[i], OutlineLinkReg))
+        {
+            std::cerr << "ERROR: " << fileName << "(" << codeLineNums[codeLineIndexes[i]] << "): "
+                      << OutlineLinkReg << " is used by a program that calls outlined macros, "
+                      << "but it holds their return address!" << std::endl;
+
+            throw std::runtime_error("Link register used with outlined macros.");
+        }
+    }
+}
+
+// ========================================================
+// resolveMacos():
+// ========================================================
+
+static void resolveMacosRange(const std::vector<std::string> & codeLines,
+                              const std::size_t begin, const std::size_t end,
+                              const std::vector<Directives> & directives,
+                              MacroExpansionCache & expansionCache,
+                              std::vector<std::string> & expandedMacros,
+                              std::vector<OutlinedCall> & outlinedCalls,
+                              std::vector<const MacroBlock *> * macroOrigins)
+{
+    // Same idea as in resolveDefines(): compare each line with each possible macro.
+    // NOTE: For simplicity, assume at most one macro invocation per line!
+    for (auto i = begin; i < end; ++i)
+    {
+        auto line = codeLines[i];
+        for (const auto & dir : directives)
+        {
+            for (const auto & mc : dir.macros)
+            {
+                const auto pos = line.find(mc.name);
+                if (pos != std::string::npos && isMacroName(line, pos, mc.name.length()))
+                {
+                    // Outlined macros are resolved once we've seen all of their calls.
+                    if (mc.isOutlined)
+                    {
+                        outlinedCalls.push_back({ i, &mc });
+                    }
+                    else
+                    {
+                        expansionCache.expand(line, mc);
+                    }
+                    if (macroOrigins != nullptr)
+                    {
+                        (*macroOrigins)[i] = &mc;
+                    }
+                    goto BREAKOUT; // Not related to the classic arcade game :P
+                }
+            }
+        }
+    BREAKOUT:
+        expandedMacros[i] = std::move(line);
+    }
+}
+
+static std::vector<std::string> resolveMacos(const std::vector<std::string> & codeLines,
+                                             const std::vector<Directives>  & directives,
+                                             MacroExpansionCache & expansionCache,
+                                             std::vector<const MacroBlock *> * macroOrigins = nullptr,
+                                             const unsigned numThreads = 1)
+{
+    std::vector<std::string> expandedMacros(codeLines.size());
+    std::vector<OutlinedCall> outlinedCalls;
+
+    // Optionally records which macro each output line came from (null if none).
+    if (macroOrigins != nullptr)
+    {
+        macroOrigins->assign(codeLines.size(), nullptr);
+    }
+
+    const auto chunks = splitIntoChunks(codeLines.size(), numThreads);
+    if (chunks.size() == 1)
+    {
+        resolveMacosRange(codeLines, 0, codeLines.size(), directives,
+                          expansionCache, expandedMacros, outlinedCalls, macroOrigins);
+    }
+    else
+    {
+        // Each chunk gets its own cache, no locking. The directives are only read.
+        std::vector<MacroExpansionCache> chunkCaches(chunks.size());
+        std::vector<std::vector<OutlinedCall>> chunkOutlinedCalls(chunks.size());
+
+        runInParallel(chunks.size(), numThreads, [&](const std::size_t c)
+        {
+            resolveMacosRange(codeLines, chunks[c].first, chunks[c].second, directives,
+                              chunkCaches[c], expandedMacros, chunkOutlinedCalls[c], macroOrigins);
+        });
+
+        for (std::size_t c = 0; c < chunks.size(); ++c)
+        {
+            expansionCache.addStats(chunkCaches[c]);
+            outlinedCalls.insert(outlinedCalls.end(), chunkOutlinedCalls[c].begin(), chunkOutlinedCalls[c].end());
+        }
+    }
+
+    // Needs all the calls in order, so this part is always serial.
+    if (!outlinedCalls.empty())
+    {
+        resolveOutlinedCalls(expandedMacros, outlinedCalls, directives, expansionCache, macroOrigins);
+    }
+
+    return expandedMacros;
+}
+
+// ========================================================
+// collectWords():
+// ========================================================
+
+static inline bool isWordChar(const char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static void collectWords(const std::string & text, std::vector<std::string> & words)
+{
+    //
+    // Gathers every name that isDefName()/isMacroName() could match
+    // in the text. Since '_' counts as punctuation for them, 'FOO_BAR'
+    // can match a 'FOO', 'BAR' or 'FOO_BAR' #define, so for each word
+    // we also add all of its '_' separated pieces.
+    //
+    const auto length = text.length();
+    std::size_t pos = 0;
+
+    while (pos < length)
+    {
+        if (!isWordChar(text[pos]))
+        {
+            ++pos;
+            continue;
+        }
+
+        const auto wordStart = pos;
+        while (pos < length && isWordChar(text[pos]))
+        {
+            ++pos;
+        }
+
+        for (auto start = wordStart; start < pos; ++start)
+        {
+            if (start != wordStart && text[start - 1] != '_')
+            {
+                continue;
+            }
+            for (auto end = start + 1; end <= pos; ++end)
+            {
+                if (end == pos || text[end] == '_')
+                {
+                    words.emplace_back(text, start, end - start);
+                }
+            }
+        }
+    }
+}
+
+// ========================================================
+// loadReferencedDirectives():
+// ========================================================
+
+static std::vector<Directives> loadReferencedDirectives(std::vector<std::unique_ptr<Preprocessor>> & includePPs,
+                                                        const std::vector<std::string> & srcCodeLines,
+                                                        const Directives & srcDirectives,
+                                                        const std::vector<Definition> & predefines)
+{
+    //
+    // Lazy #include parsing: index each include file, then only load
+    // the #defines and #macros referenced by the source, plus the ones
+    // referenced by those (a define value can contain another define,
+    // a macro body can use defines) until nothing new turns up.
+    //
+    // Replacing macro parameters can also form new names: with a 'LIGHT'
+    // parameter, a 'LIGHT_COLOR' in the body becomes 'SUN_COLOR' in the call
+    // 'Shade{ vf01, SUN }', so the calls of such macros are expanded and
+    // scanned as well.
+    //
+    using EntryRef = std::pair<std::size_t, std::size_t>; // [include, entry]
+
+    std::unordered_map<std::string, std::vector<EntryRef>> entriesByName;
+    std::vector<EntryRef> pendingEntries;
+
+    // The includes were indexed as the source was parsed.
+    for (std::size_t i = 0; i < includePPs.size(); ++i)
+    {
+        const auto & index = includePPs[i]->getIndex();
+        for (std::size_t e = 0; e < index.size(); ++e)
+        {
+            const auto & name = index[e].name;
+            if (std::all_of(name.begin(), name.end(), isWordChar))
+            {
+                entriesByName[name].emplace_back(i, e);
+            }
+            else
+            {
+                // Odd names like 'FOO.x' are not found by collectWords(), so always load them.
+                pendingEntries.emplace_back(i, e);
+            }
+        }
+    }
+
+    std::unordered_set<std::string> seenWords;
+    std::vector<std::string> words;
+
+    auto scanText = [&](const std::string & text)
+    {
+        words.clear();
+        collectWords(text, words);
+
+        for (auto && word : words)
+        {
+            if (seenWords.insert(word).second)
+            {
+                const auto iter = entriesByName.find(word);
+                if (iter != entriesByName.end())
+                {
+                    pendingEntries.insert(pendingEntries.end(), iter->second.begin(), iter->second.end());
+                }
+            }
+        }
+    };
+
+    for (auto && line : srcCodeLines)
+    {
+        scanText(line);
+    }
+    for (auto && def : srcDirectives.defines)
+    {
+        scanText(def.value);
+    }
+    for (auto && def : predefines)
+    {
+        scanText(def.value);
+    }
+    for (auto && mc : srcDirectives.macros)
+    {
+        for (auto && line : mc.lines)
+        {
+            scanText(line);
+        }
+    }
+
+    // Macros with parameters whose calls still have to be scanned.
+    std::vector<const MacroBlock *> macrosToExpand;
+    for (auto && mc : srcDirectives.macros)
+    {
+        if (!mc.params.empty())
+        {
+            macrosToExpand.push_back(&mc);
+        }
+    }
+
+    auto scanMacroCalls = [&](const MacroBlock & mc)
+    {
+        std::string bodyLine;
+        for (auto && line : srcCodeLines)
+        {
+            const auto pos = line.find(mc.name);
+            if (pos == std::string::npos || !isMacroName(line, pos, mc.name.length()))
+            {
+                continue;
+            }
+
+            // A wrong number of arguments is reported when the call is expanded for real.
+            const auto args = getMacroArgs(line);
+            if (args.size() != mc.params.size())
+            {
+                continue;
+            }
+
+            for (auto && l : mc.lines)
+            {
+                bodyLine = l;
+                for (std::size_t p = 0; p < mc.params.size(); ++p)
+                {
+                    doReplaceDefs(bodyLine, mc.params[p], args[p]);
+                }
+                scanText(bodyLine);
+            }
+        }
+    };
+
+    do
+    {
+        while (!pendingEntries.empty())
+        {
+            const auto ref = pendingEntries.back();
+            pendingEntries.pop_back();
+
+            auto & pp = *includePPs[ref.first];
+            if (pp.getIndex()[ref.second].isLoaded)
+            {
+                continue;
+            }
+
+            const auto & entry = pp.loadIndexEntry(ref.second);
+            if (entry.isMacro)
+            {
+                for (auto && line : entry.macro.lines)
+                {
+                    scanText(line);
+                }
+                if (!entry.macro.params.empty())
+                {
+                    macrosToExpand.push_back(&entry.macro);
+                }
+            }
+            else
+            {
+                scanText(entry.define.value);
+            }
+        }
+
+        while (!macrosToExpand.empty())
+        {
+            const auto mc = macrosToExpand.back();
+            macrosToExpand.pop_back();
+            scanMacroCalls(*mc);
+        }
+    }
+    while (!pendingEntries.empty());
+
+    std::vector<Directives> loadedDirectives;
+    loadedDirectives.reserve(includePPs.size());
+
+    for (auto && pp : includePPs)
+    {
+        loadedDirectives.emplace_back(pp->takeLoadedDirectives());
+    }
+    return loadedDirectives;
+}
+
+// ========================================================
+// writeVcl[Prologue/Epilogue]:
+// ========================================================
+
+static void writeVclPrologue(std::ostream & outFile)
+{
+    //
+    //outFile << ".init_vi_all\n";
+    //
+    // init_vi_all causes problems when using clipping
+    // instructions. The VU1 clipw and FC flag helpers
+    // require using register VI01 directly and OpenVCL
+    // doesn't seem to respect our uses of VI01 when
+    // init_vi_all is set, reusing it for other variables,
+    // which ends up causing the clip instructions to
+    // override other data. Explicitly specifying which
+    // registers OpenVCL can use fixes the problem by
+    // leaving VI01 out of the list. You'll get one less
+    // register to work with if you're not doing clipping,
+    // but the vast majority of programs will, and you
+    // still have 13 regs to play with, so this should
+    // be okay.
+    //
+    outFile << "\n";
+    outFile << ".init_vi VI02, VI03, VI04, VI05, VI06, VI07, VI08, VI09, VI10, VI11, VI12, VI13, VI14\n";
+    outFile << ".init_vf_all\n";
+    outFile << ".syntax new\n";
+    outFile << ".vu\n";
+    outFile << "\n";
+    outFile << "--enter\n";
+    outFile << "--endenter\n";
+    outFile << "\n";
+}
+
+static void writeVclEpilogue(std::ostream & outFile)
+{
+    outFile << "\n";
+    outFile << "--exit\n";
+    outFile << "--endexit\n";
+    outFile << "\n";
+}
+
+// ========================================================
+// stripComments():
+// ========================================================
+
+static void stripComments(std::string & s)
+{
+    // The only type of comment we handle is ';'
+    auto pos = s.find_first_of(';');
+    while (pos != std::string::npos)
+    {
+        // Remove everything after the comment start, up to the end of the line.
+        // An expanded macro has several lines, so keep the ones that follow.
+        const auto lineEnd = s.find_first_of('\n', pos);
+        s.erase(pos, (lineEnd == std::string::npos) ? std::string::npos : lineEnd - pos);
+        pos = s.find_first_of(';', pos);
+    }
+}
+
+// ========================================================
+// class CodeSizeReport:
+// ========================================================
+
+// Counts the instructions in the output, attributing them to the macro
+// invocation or plain source line they came from, so we can find out
+// what is eating up the VU micro memory (-r and --max-instructions).
+class CodeSizeReport final
+{
+private:
+
+    struct CallSite
+    {
+        std::string macroName;
+        int lineNum;
+        int expansions;   // More than one if the call is inside a #repeat.
+        int instructions;
+    };
+
+    std::string fileName;
+    std::vector<CallSite> callSites;
+    std::unordered_map<std::string, std::size_t> callSiteIndices; // "macro@line" => callSites[]
+    int inlineInstructions;
+    int totalInstructions;
+
+    // Anything at or above this share of the total is flagged.
+    static constexpr double LargeShare = 0.10;
+
+    std::string percentOf(const int instructions) const
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%5.1f%%",
+                      (totalInstructions > 0) ? (100.0 * instructions / totalInstructions) : 0.0);
+        return buffer;
+    }
+
+    std::string flagIfLarge(const int instructions) const
+    {
+        return (totalInstructions > 0 && instructions >= LargeShare * totalInstructions) ? "  <== large" : "";
+    }
+
+    std::string formatLocation(const CallSite & site) const
+    {
+        // Line zero is the shared body of an outlined macro.
+        return (site.lineNum != 0) ? fileName + "(" + std::to_string(site.lineNum) + ")" : "(outlined subroutine)";
+    }
+
+    std::vector<CallSite> sortedCallSites() const
+    {
+        auto sorted = callSites;
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const CallSite & a, const CallSite & b) { return a.instructions > b.instructions; });
+        return sorted;
+    }
+
+public:
+
+    explicit CodeSizeReport(std::string srcFileName)
+        : fileName           { std::move(srcFileName) }
+        , inlineInstructions { 0 }
+        , totalInstructions  { 0 }
+    { }
+
+    int getTotalInstructions() const { return totalInstructions; }
+
+    // Labels, assembler directives (.name, .align) and VCL
+    // directives (--cont, --barrier) are not instructions.
+    static int countInstructions(const std::string & text)
+    {
+        int count = 0;
+        std::istringstream lines{ text };
+        std::string line, firstToken;
+
+        while (std::getline(lines, line))
+        {
+            std::istringstream tokenizer{ line };
+            if (!(tokenizer >> firstToken) || firstToken[0] == '.' || firstToken.compare(0, 2, "--") == 0)
+            {
+                continue;
+            }
+            if (firstToken.back() == ':' && !(tokenizer >> firstToken))
+            {
+                continue; // Label alone in the line.
+            }
+            ++count;
+        }
+        return count;
+    }
+
+    void addCode(const MacroBlock * macro, const int lineNum, const int instructions)
+    {
+        totalInstructions += instructions;
+        if (macro == nullptr)
+        {
+            inlineInstructions += instructions;
+            return;
+        }
+
+        const auto key = macro->name + "@" + std::to_string(lineNum);
+        const auto iter = callSiteIndices.find(key);
+        if (iter != callSiteIndices.end())
+        {
+            callSites[iter->second].expansions++;
+            callSites[iter->second].instructions += instructions;
+        }
+        else
+        {
+            callSiteIndices.emplace(key, callSites.size());
+            callSites.push_back({ macro->name, lineNum, 1, instructions });
+        }
+    }
+
+    // Top call sites, one per line.
+    std::string formatLargestCallSites(const std::size_t maxCount) const
+    {
+        std::ostringstream out;
+        const auto sorted = sortedCallSites();
+
+        for (std::size_t i = 0; i < sorted.size() && i < maxCount; ++i)
+        {
+            const auto & site = sorted[i];
+            out << "  " << formatLocation(site) << ": " << site.macroName
+                << " x" << site.expansions << " = " << site.instructions
+                << " instructions (" << percentOf(site.instructions) << ")\n";
+        }
+        return out.str();
+    }
+
+    std::string format() const
+    {
+        std::ostringstream out;
+
+        out << "Code size report for '" << fileName << "': " << totalInstructions << " instructions, "
+            << inlineInstructions << " inline and " << (totalInstructions - inlineInstructions)
+            << " from " << callSites.size() << " macro call sites.\n";
+
+        // Per macro totals, in order of first use:
+        std::vector<CallSite> perMacro;
+        for (auto && site : callSites)
+        {
+            auto iter = std::find_if(perMacro.begin(), perMacro.end(),
+                                     [&site](const CallSite & m) { return m.macroName == site.macroName; });
+            if (iter == perMacro.end())
+            {
+                perMacro.push_back({ site.macroName, 0, 0, 0 });
+                iter = perMacro.end() - 1;
+            }
+            iter->expansions   += site.expansions;
+            iter->instructions += site.instructions;
+        }
+        std::stable_sort(perMacro.begin(), perMacro.end(),
+                         [](const CallSite & a, const CallSite & b) { return a.instructions > b.instructions; });
+
+        out << "\n Per macro:\n";
+        out << "  instructions   share  invocations  macro\n";
+        for (auto && m : perMacro)
+        {
+            char buffer[64];
+            std::snprintf(buffer, sizeof(buffer), "  %12d  %s  %11d  ", m.instructions,
+                          percentOf(m.instructions).c_str(), m.expansions);
+            out << buffer << m.macroName << flagIfLarge(m.instructions) << "\n";
+        }
+
+        out << "\n Per call site:\n";
+        out << "  instructions   share  invocations  location\n";
+        for (auto && site : sortedCallSites())
+        {
+            char buffer[64];
+            std::snprintf(buffer, sizeof(buffer), "  %12d  %s  %11d  ", site.instructions,
+                          percentOf(site.instructions).c_str(), site.expansions);
+            out << buffer << formatLocation(site) << ": " << site.macroName
+                << flagIfLarge(site.instructions) << "\n";
+        }
+        out << "\n";
+        return out.str();
+    }
+}; // class CodeSizeReport
+
+// ========================================================
+// struct ExpansionIndex:
+// ========================================================
+
+// 64-bit FNV-1a. Stable across runs and platforms, unlike std::hash.
+static std::uint64_t hashString(const std::string & s)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const char c : s)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+//
+// The '.ppi' file kept next to the output by the -i/--incremental mode.
+// For the run that wrote the output, it has a hash of each source code
+// line, a hash of each #define/#macro and the code lines that used it.
+// The next run compares the hashes and only expands again the code lines
+// that changed or that used a changed #define/#macro. The output of the
+// other lines is copied from the previous output file.
+//
+struct ExpansionIndex
+{
+    struct LineRecord
+    {
+        std::uint64_t textHash     = 0;
+        int           outputLines  = 0; // Lines it wrote to the output. Zero if blank.
+        int           instructions = 0; // For the code size report.
+    };
+
+    struct SymbolRecord
+    {
+        bool          isMacro   = false;
+        std::string   name;
+        std::uint64_t valueHash = 0;
+        std::vector<std::size_t> usedBy; // Code line indexes, in increasing order.
+    };
+
+    // Anything that affects the whole output, like the flags and the program name.
+    std::uint64_t settingsHash = 0;
+
+    // Of the output file written with this index, to detect outside edits.
+    std::uint64_t outputHash = 0;
+
+    // One per source code line.
+    std::vector<LineRecord> lines;
+
+    // #defines in directive order, then #macros in directive order.
+    std::vector<SymbolRecord> symbols;
+
+    bool save(const std::string & filename) const
+    {
+        std::ofstream file{ filename };
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        file << "vclpp-index 1\n";
+        file << "settings " << std::hex << settingsHash << "\n";
+        file << "output " << outputHash << std::dec << "\n";
+
+        file << "lines " << lines.size() << "\n";
+        for (auto && line : lines)
+        {
+            file << std::hex << line.textHash << std::dec << " " << line.outputLines << " " << line.instructions << "\n";
+        }
+
+        // Uses are written as ranges 'first-last', since a constant
+        // tends to be used by runs of consecutive lines.
+        file << "symbols " << symbols.size() << "\n";
+        for (auto && symbol : symbols)
+        {
+            file << (symbol.isMacro ? "M " : "D ") << symbol.name << " "
+                 << std::hex << symbol.valueHash << std::dec;
+
+            for (std::size_t u = 0; u < symbol.usedBy.size(); )
+            {
+                auto last = u;
+                while (last + 1 < symbol.usedBy.size() && symbol.usedBy[last + 1] == symbol.usedBy[last] + 1)
+                {
+                    ++last;
+                }
+
+                file << " " << symbol.usedBy[u];
+                if (last != u)
+                {
+                    file << "-" << symbol.usedBy[last];
+                }
+                u = last + 1;
+            }
+            file << "\n";
+        }
+
+        return file.good();
+    }
+
+    bool load(const std::string & filename)
+    {
+        std::ifstream file{ filename };
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        std::string tag;
+        int version = 0;
+        std::size_t count = 0;
+
+        if (!(file >> tag >> version) || tag != "vclpp-index" || version != 1 ||
+            !(file >> tag >> std::hex >> settingsHash) || tag != "settings" ||
+            !(file >> tag >> outputHash >> std::dec) || tag != "output" ||
+            !(file >> tag >> count) || tag != "lines")
+        {
+            return false;
+        }
+
+        lines.resize(count);
+        for (auto && line : lines)
+        {
+            if (!(file >> std::hex >> line.textHash >> std::dec >> line.outputLines >> line.instructions))
+            {
+                return false;
+            }
+        }
+
+        if (!(file >> tag >> count) || tag != "symbols")
+        {
+            return false;
+        }
+
+        // Rest of each line is the list of uses.
+        std::string symbolLine;
+        std::getline(file, symbolLine);
+
+        symbols.resize(count);
+        for (auto && symbol : symbols)
+        {
+            if (!std::getline(file, symbolLine))
+            {
+                return false;
+            }
+
+            std::istringstream fields{ symbolLine };
+            if (!(fields >> tag >> symbol.name >> std::hex >> symbol.valueHash >> std::dec) || (tag != "M" && tag != "D"))
+            {
+                return false;
+            }
+            symbol.isMacro = (tag == "M");
+
+            std::string range;
+            while (fields >> range)
+            {
+                const auto dash  = range.find('-');
+                const auto first = std::strtoull(range.c_str(), nullptr, 10);
+                const auto last  = (dash != std::string::npos) ? std::strtoull(range.c_str() + dash + 1, nullptr, 10) : first;
+
+                if (last < first || last >= lines.size())
+                {
+                    return false;
+                }
+                for (auto u = first; u <= last; ++u)
+                {
+                    symbol.usedBy.push_back(static_cast<std::size_t>(u));
+                }
+            }
+        }
+
+        return true;
+    }
+};
+
+// State of the -i/--incremental mode for one output file.
+struct IncrementalBuild
+{
+    // From the previous run. Only valid if hasPrevious is set.
+    ExpansionIndex previousIndex;
+    std::string    previousOutput;
+    bool           hasPrevious = false;
+
+    // Filled in by runPreprocessor() for the next run.
+    ExpansionIndex index;
+};
+
+static void buildExpansionIndex(const std::vector<std::string> & codeLines,
+                                const std::vector<Directives>  & directives,
+                                const std::string & settings, ExpansionIndex & index,
+                                std::vector<const MacroBlock *> & symbolMacros)
+{
+    index.settingsHash = hashString(settings);
+
+    index.lines.resize(codeLines.size());
+    for (std::size_t i = 0; i < codeLines.size(); ++i)
+    {
+        index.lines[i].textHash = hashString(codeLines[i]);
+    }
+
+    // Same order resolveDefines() counts the #defines in, so its
+    // define indexes are also symbol indexes. Macros come after.
+    for (const auto & dir : directives)
+    {
+        for (const auto & def : dir.defines)
+        {
+            index.symbols.push_back({ false, def.name, hashString(def.value), {} });
+            symbolMacros.push_back(nullptr);
+        }
+    }
+
+    for (const auto & dir : directives)
+    {
+        for (const auto & mc : dir.macros)
+        {
+            std::string value = mc.isOutlined ? "outline\n" : "\n";
+            for (auto && param : mc.params)
+            {
+                value += param + ",";
+            }
+            for (auto && line : mc.lines)
+            {
+                value += "\n" + line;
+            }
+
+            index.symbols.push_back({ true, mc.name, hashString(value), {} });
+            symbolMacros.push_back(&mc);
+        }
+    }
+}
+
+// Finds the code lines that have to be expanded again. Returns false if the
+// previous run is not comparable, e.g. a #define was added or the flags differ,
+// in which case everything has to be expanded.
+static bool findChangedLines(const ExpansionIndex & previous, const ExpansionIndex & current,
+                             std::vector<std::size_t> & changedLines)
+{
+    if (previous.settingsHash != current.settingsHash ||
+        previous.lines.size() != current.lines.size() ||
+        previous.symbols.size() != current.symbols.size())
+    {
+        return false;
+    }
+
+    std::vector<bool> isChanged(current.lines.size(), false);
+    for (std::size_t i = 0; i < current.lines.size(); ++i)
+    {
+        isChanged[i] = (previous.lines[i].textHash != current.lines[i].textHash);
+    }
+
+    // The order matters too: the first matching #macro and the first #define win.
+    for (std::size_t s = 0; s < current.symbols.size(); ++s)
+    {
+        const auto & before = previous.symbols[s];
+        const auto & now    = current.symbols[s];
+
+        if (before.isMacro != now.isMacro || before.name != now.name)
+        {
+            return false;
+        }
+        if (before.valueHash != now.valueHash)
+        {
+            for (auto u : before.usedBy)
+            {
+                isChanged[u] = true;
+            }
+        }
+    }
+
+    changedLines.clear();
+    for (std::size_t i = 0; i < isChanged.size(); ++i)
+    {
+        if (isChanged[i])
+        {
+            changedLines.push_back(i);
+        }
+    }
+    return true;
+}
+
+// The subroutines of outlined macros all go at the end of the output, so
+// their call sites can't be patched in place. True if there are any in
+// the previous output or in the lines about to be expanded.
+static bool callsOutlinedMacros(const ExpansionIndex & previous, const std::vector<const MacroBlock *> & symbolMacros,
+                                const std::vector<std::string> & codeLines, const std::vector<std::size_t> & changedLines)
+{
+    for (std::size_t s = 0; s < symbolMacros.size(); ++s)
+    {
+        const auto mc = symbolMacros[s];
+        if (mc == nullptr || !mc->isOutlined)
+        {
+            continue;
+        }
+        if (!previous.symbols[s].usedBy.empty())
+        {
+            return true;
+        }
+        for (auto i : changedLines)
+        {
+            const auto pos = codeLines[i].find(mc->name);
+            if (pos != std::string::npos && isMacroName(codeLines[i], pos, mc->name.length()))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Byte offsets of the output of each code line in the previous output,
+// plus the end of the last one. False if the index doesn't match it.
+static bool splitPreviousOutput(const std::string & output, const ExpansionIndex & index,
+                                const std::size_t headerLines, std::vector<std::size_t> & offsets)
+{
+    std::size_t pos = 0;
+    auto skipLines = [&](std::size_t count)
+    {
+        for (; count != 0; --count)
+        {
+            pos = output.find('\n', pos);
+            if (pos == std::string::npos)
+            {
+                return false;
+            }
+            ++pos;
+        }
+        return true;
+    };
+
+    if (!skipLines(headerLines))
+    {
+        return false;
+    }
+
+    offsets.clear();
+    for (auto && line : index.lines)
+    {
+        offsets.push_back(pos);
+        if (!skipLines(line.outputLines))
+        {
+            return false;
+        }
+    }
+    offsets.push_back(pos);
+    return true;
+}
+
+// ========================================================
+// runPreprocessor():
+// ========================================================
+
+struct PreprocessorOptions
+{
+    bool addVclJunk   = false;
+    bool fixCExpr     = false;
+    bool lazyIncludes = false;
+
+    // Command-line/variant defines.
+    std::vector<Definition> predefines;
+
+    // Appended to the '.name' of the VU program (variant mode).
+    std::string progNameSuffix;
+
+    // Code size report/limit. Zero means no limit.
+    bool printCodeSizeReport = false;
+    int  maxInstructions     = 0;
+
+    // Prints macro expansion cache statistics.
+    bool printStats = false;
+
+    // Threads for expanding large sources (and variants).
+    unsigned numThreads = 1;
+
+    // Only expand again what changed since the last run, see ExpansionIndex.
+    bool incremental = false;
+
+    // Driver mode: max downstream commands running at once.
+    unsigned maxJobs = 1;
+};
+
+static void runPreprocessor(const std::string & srcFile, std::ostream & outFile,
+                            const PreprocessorOptions & options, SourceCache & sourceCache,
+                            IncrementalBuild * incremental = nullptr)
+{
+    const auto & predefines = options.predefines;
+
+    // Source file is the root where substitutions take place.
+    // Its #includes are opened as their directives are found.
+    Preprocessor srcPP{ srcFile, false, predefines, sourceCache, options.lazyIncludes };
+    auto srcDirectives = srcPP.parseDirectives();
+
+    const auto & srcCodeLines = srcPP.getCodeLines();
+
+    // The #included files can't have other includes.
+    // There's no support for recursive includes right now.
+    std::vector<Directives> additionalDirectives;
+
+    if (options.lazyIncludes)
+    {
+        additionalDirectives = loadReferencedDirectives(srcPP.getIncludes(), srcCodeLines, srcDirectives, predefines);
+    }
+    else
+    {
+        additionalDirectives = srcPP.takeIncludeDirectives();
+    }
+
+    // We can release this memory now.
+    srcPP.getIncludes().clear();
+
+    // Now that the list of dependencies is resolved and we
+    // have all macros and defines, we can substitute in the
+    // source file.
+
+    // Merge 'em. Command-line defines go first, so they take precedence:
+    additionalDirectives.insert(additionalDirectives.begin(), Directives{ {}, predefines, {} });
+    additionalDirectives.emplace_back(std::move(srcDirectives));
+
+    // The '.name' and VCL junk go before the code.
+    std::ostringstream header;
+    if (!srcPP.getVuProgName().empty())
+    {
+        header << "\n.name " << srcPP.getVuProgName() << options.progNameSuffix << "\n";
+    }
 
-            // Hexadecimal output:
-            //char buffer[256];
-            //std::snprintf(buffer, sizeof(buffer), "0x%lX", result);
-            //tk.replace(start, start + end, buffer);
+    if (options.addVclJunk)
+    {
+        writeVclPrologue(header);
+    }
+    const auto headerText = header.str();
+
+    const bool trackCodeSize = (options.printCodeSizeReport || options.maxInstructions > 0);
+    const std::size_t numCodeLines = srcCodeLines.size();
+
+    // In incremental mode, only the code lines that changed or used a #define/#macro
+    // that changed since the previous run are expanded. The output of the others is
+    // copied from the previous output file.
+    std::vector<std::size_t> linesToExpand;
+    std::vector<std::size_t> previousOffsets;
+    std::vector<const MacroBlock *> symbolMacros;
+    bool reusePrevious = false;
+
+    if (incremental != nullptr)
+    {
+        const std::string settings = headerText + (options.fixCExpr ? "fixcexpr\n" : "\n");
+        buildExpansionIndex(srcCodeLines, additionalDirectives, settings, incremental->index, symbolMacros);
+
+        reusePrevious = incremental->hasPrevious &&
+                        findChangedLines(incremental->previousIndex, incremental->index, linesToExpand) &&
+                        !callsOutlinedMacros(incremental->previousIndex, symbolMacros, srcCodeLines, linesToExpand) &&
+                        splitPreviousOutput(incremental->previousOutput, incremental->previousIndex,
+                                            std::count(headerText.begin(), headerText.end(), '\n'), previousOffsets);
+    }
 
-            // Decimal output:
-            tk.replace(start, start + end, std::to_string(result));
+    std::vector<std::string> changedCodeLines;
+    if (reusePrevious)
+    {
+        for (auto i : linesToExpand)
+        {
+            changedCodeLines.push_back(srcCodeLines[i]);
+        }
+    }
+    else
+    {
+        linesToExpand.clear();
+        for (std::size_t i = 0; i < numCodeLines; ++i)
+        {
+            linesToExpand.push_back(i);
         }
+    }
+    const auto & codeLinesToExpand = reusePrevious ? changedCodeLines : srcCodeLines;
 
-        newLine += tk; newLine += " ";
+    // #macro expansion:
+    std::vector<const MacroBlock *> macroOrigins;
+    MacroExpansionCache expansionCache;
+    auto expandedMacros = resolveMacos(codeLinesToExpand, additionalDirectives, expansionCache,
+                                       (trackCodeSize || incremental != nullptr) ? &macroOrigins : nullptr,
+                                       options.numThreads);
+
+    if (options.printStats)
+    {
+        std::cout << srcPP.getCurrentFileName() << ": " << expansionCache.formatStats();
+        if (incremental != nullptr)
+        {
+            std::cout << srcPP.getCurrentFileName() << ": Expanded " << linesToExpand.size()
+                      << " of " << numCodeLines << " code lines.\n";
+        }
     }
 
-    line = std::move(newLine);
-}
+    // #define expansion and we are done:
+    std::vector<std::vector<std::uint32_t>> definesUsed;
+    auto finalProcessedText = resolveDefines(expandedMacros, additionalDirectives,
+                                             (incremental != nullptr) ? &definesUsed : nullptr,
+                                             options.numThreads);
 
-// ========================================================
-// isDefName()/isMacroName():
-// ========================================================
+    // Outlined macro subroutines were appended, so vi15 is now reserved.
+    if (finalProcessedText.size() > linesToExpand.size())
+    {
+        checkLinkRegisterUnused(finalProcessedText, linesToExpand, srcPP.getCodeLineNums(), srcPP.getCurrentFileName());
+    }
 
-static inline bool isDefName(const std::string & s, const long pos, const long len)
-{
-    //
-    // A macro/define name referenced in the text/code must
-    // be either surrounded by whitespace or punctuation.
-    //
-    // E.g.: func(FOO+42);
-    // Where 'FOO' is a #define constant.
     //
-    // This checking is necessary to avoid replacing
-    // accidental things like in a "FOOBAR" string.
+    // Finally, write the output:
     //
+    outFile << headerText;
 
-    const long prevChar = pos - 1;
-    const long postChar = pos + len;
+    CodeSizeReport codeSize{ srcPP.getCurrentFileName() };
+    const auto & srcCodeLineNums = srcPP.getCodeLineNums();
+    const bool countInstructions = (trackCodeSize || incremental != nullptr);
 
-    // At the left end
-    if (prevChar <= 0)
+    // Returns the output lines and instructions written.
+    auto writeExpandedLine = [&](std::string & line)
     {
-        return (postChar >= static_cast<long>(s.length())) ||
-               (std::isspace(s[postChar]) || std::ispunct(s[postChar]));
+        ExpansionIndex::LineRecord written;
+
+        stripComments(line);
+        if (!isBlank(line))
+        {
+            if (options.fixCExpr)
+            {
+                // Resolve exprs like 1+2 resulting from #define replacement.
+                fixupConstExpressions(line);
+            }
+            outFile << line << "\n";
+
+            written.outputLines = 1 + static_cast<int>(std::count(line.begin(), line.end(), '\n'));
+            if (countInstructions)
+            {
+                written.instructions = CodeSizeReport::countInstructions(line);
+            }
+        }
+        return written;
+    };
+
+    // Lines copied from the previous output keep their uses and macro.
+    std::vector<const MacroBlock *> previousOrigins;
+    if (reusePrevious)
+    {
+        std::vector<bool> isExpanded(numCodeLines, false);
+        for (auto i : linesToExpand)
+        {
+            isExpanded[i] = true;
+        }
+
+        previousOrigins.assign(numCodeLines, nullptr);
+        const auto & previousSymbols = incremental->previousIndex.symbols;
+
+        for (std::size_t s = 0; s < previousSymbols.size(); ++s)
+        {
+            for (auto u : previousSymbols[s].usedBy)
+            {
+                if (!isExpanded[u])
+                {
+                    incremental->index.symbols[s].usedBy.push_back(u);
+                    if (symbolMacros[s] != nullptr)
+                    {
+                        previousOrigins[u] = symbolMacros[s];
+                    }
+                }
+            }
+        }
     }
-    // At the right end
-    if (postChar >= static_cast<long>(s.length()))
+
+    std::unordered_map<const MacroBlock *, std::size_t> macroSymbols;
+    for (std::size_t s = 0; s < symbolMacros.size(); ++s)
     {
-        return (prevChar <= 0) ||
-               (std::isspace(s[prevChar]) || std::ispunct(s[prevChar]));
+        if (symbolMacros[s] != nullptr)
+        {
+            macroSymbols.emplace(symbolMacros[s], s);
+        }
     }
-    // In the middle
-    return (std::isspace(s[prevChar]) || std::ispunct(s[prevChar])) &&
-           (std::isspace(s[postChar]) || std::ispunct(s[postChar]));
-}
 
-static inline bool isMacroName(const std::string & s, const long pos, const long len)
-{
-    const long prevChar = pos - 1;
-    const long postChar = pos + len;
+    std::size_t next = 0; // Into linesToExpand/finalProcessedText.
+    for (std::size_t i = 0; i < numCodeLines; ++i)
+    {
+        ExpansionIndex::LineRecord written;
+        const MacroBlock * origin = nullptr;
 
-    // At the left end
-    if (prevChar <= 0)
+        if (next < linesToExpand.size() && linesToExpand[next] == i)
+        {
+            written = writeExpandedLine(finalProcessedText[next]);
+            origin  = macroOrigins.empty() ? nullptr : macroOrigins[next];
+
+            if (incremental != nullptr)
+            {
+                auto & symbols = incremental->index.symbols;
+                if (origin != nullptr)
+                {
+                    symbols[macroSymbols[origin]].usedBy.push_back(i);
+                }
+                for (auto d : definesUsed[next])
+                {
+                    symbols[d].usedBy.push_back(i);
+                }
+            }
+            ++next;
+        }
+        else
+        {
+            const auto & previous = incremental->previousIndex.lines[i];
+            outFile.write(incremental->previousOutput.data() + previousOffsets[i],
+                          previousOffsets[i + 1] - previousOffsets[i]);
+
+            written.outputLines  = previous.outputLines;
+            written.instructions = previous.instructions;
+            origin = previousOrigins[i];
+        }
+
+        if (incremental != nullptr)
+        {
+            incremental->index.lines[i].outputLines  = written.outputLines;
+            incremental->index.lines[i].instructions = written.instructions;
+        }
+
+        if (trackCodeSize && written.outputLines != 0)
+        {
+            codeSize.addCode(origin, srcCodeLineNums[i], written.instructions);
+        }
+    }
+
+    // Outlined macro subroutines are appended after the source lines, so have no call site.
+    for (; next < finalProcessedText.size(); ++next)
     {
-        // Must have a '{' to the right-hand side
-        return postChar < static_cast<long>(s.length()) && s[postChar] == '{';
+        const auto written = writeExpandedLine(finalProcessedText[next]);
+        if (trackCodeSize && written.outputLines != 0)
+        {
+            codeSize.addCode(macroOrigins[next], 0, written.instructions);
+        }
     }
-    // At the right end
-    if (postChar >= static_cast<long>(s.length()))
+
+    if (incremental != nullptr)
     {
-        // Missing the '{'?
-        return false;
+        for (auto && symbol : incremental->index.symbols)
+        {
+            std::sort(symbol.usedBy.begin(), symbol.usedBy.end());
+        }
+    }
+
+    if (options.addVclJunk)
+    {
+        writeVclEpilogue(outFile);
+    }
+
+    if (options.printCodeSizeReport)
+    {
+        std::cout << codeSize.format();
+    }
+
+    if (options.maxInstructions > 0 && codeSize.getTotalInstructions() > options.maxInstructions)
+    {
+        std::cerr << "ERROR: " << srcPP.getCurrentFileName() << ": " << codeSize.getTotalInstructions()
+                  << " instructions exceed the limit of " << options.maxInstructions
+                  << ". Largest macro call sites:\n" << codeSize.formatLargestCallSites(5);
+        throw std::runtime_error("Instruction limit exceeded.");
     }
-    // In the middle
-    return (std::isspace(s[prevChar]) || std::ispunct(s[prevChar])) && (s[postChar] == '{');
 }
 
 // ========================================================
-// doReplaceDefs():
+// removeFilenameExtension():
 // ========================================================
 
-static inline void doReplaceDefs(std::string & line, const std::string & search, const std::string & replace)
+static std::string removeFilenameExtension(const std::string & filename)
 {
-    for (std::size_t pos = 0; ; pos += replace.length())
+	const auto lastDot = filename.find_last_of('.');
+	if (lastDot == std::string::npos)
+	{
+		return filename;
+	}
+	return filename.substr(0, lastDot);
+}
+
+// ========================================================
+// writePreprocessedFile():
+// ========================================================
+
+static void writePreprocessedFile(const std::string & srcFile, const std::string & destFile,
+                                  const PreprocessorOptions & options, SourceCache & sourceCache)
+{
+    // The incremental mode index lives next to the output.
+    const auto indexFile = removeFilenameExtension(destFile) + ".ppi";
+    IncrementalBuild incremental;
+
+    if (options.incremental)
     {
-        if ((pos = line.find(search, pos)) == std::string::npos)
+        // Missing, or the output was changed by someone else? Then it's a full run.
+        std::ifstream previousFile{ destFile };
+        if (previousFile.is_open() && incremental.previousIndex.load(indexFile))
         {
-            break;
+            std::ostringstream contents;
+            contents << previousFile.rdbuf();
+            incremental.previousOutput = contents.str();
+            incremental.hasPrevious = (hashString(incremental.previousOutput) == incremental.previousIndex.outputHash);
         }
-        if (isDefName(line, pos, search.length()))
+    }
+
+    std::ostringstream outText;
+    try
+    {
+        runPreprocessor(srcFile, outText, options, sourceCache, options.incremental ? &incremental : nullptr);
+    }
+    catch (...)
+    {
+        // Don't leave a stale program (or one that won't fit) lying around for the next build step.
+        std::remove(destFile.c_str());
+        if (options.incremental)
         {
-            line.erase(pos, search.length());
-            line.insert(pos, replace);
+            std::remove(indexFile.c_str());
+        }
+        throw;
+    }
+
+    std::ofstream outFile{ destFile };
+    if (!outFile.is_open() || !outFile.good())
+    {
+        std::cerr << "Unable to open file \"" << destFile << "\" for writing." << std::endl;
+        throw std::runtime_error("Can't open output file.");
+    }
+
+    const auto text = outText.str();
+    outFile << text;
+
+    if (options.incremental)
+    {
+        incremental.index.outputHash = hashString(text);
+        if (!incremental.index.save(indexFile))
+        {
+            std::cerr << "WARNING: Unable to write index file \"" << indexFile << "\". Next run won't be incremental." << std::endl;
+            std::remove(indexFile.c_str());
         }
     }
 }
 
 // ========================================================
-// resolveDefines():
+// runVariants():
 // ========================================================
 
-static std::vector<std::string> resolveDefines(const std::vector<std::string> & codeLines,
-                                               const std::vector<Directives>  & directives)
+struct Variant
 {
-    std::vector<std::string> expandedDefs;
+    std::string name;
+    std::vector<Definition> defines;
+};
 
-    // We have to test each line of the source with each #define
-    // found inside the source file plus all of its #includes, so
-    // you can imagine this triple looping is not very scalable.
-    // Luckily our inputs are small, so this rudimentary text
-    // replacement still performs reasonably well.
-    for (auto line : codeLines)
+static void runVariants(const std::string & srcFile, const std::string & destFile,
+                        const PreprocessorOptions & options, const std::vector<Variant> & variants)
+{
+    //
+    // Preprocesses the same source once per variant, each with its own set of
+    // defines, writing '<output>_<variant>.vsm' files. Variants run in parallel
+    // and share a SourceCache, so the source and #includes are only loaded once.
+    // #includes are also parsed once, except for the ones with conditionals that
+    // depend on the variant defines. The source is scanned again for each variant,
+    // since the #if branches taken differ.
+    //
+    SourceCache sourceCache;
+    const auto outBaseName = removeFilenameExtension(destFile);
+    std::atomic<int> variantsFailed{ 0 };
+
+    // Whatever threads are left after one per variant go to expanding each of them.
+    const auto threadsPerVariant = std::max<unsigned>(1, options.numThreads / static_cast<unsigned>(variants.size()));
+
+    runInParallel(variants.size(), options.numThreads, [&](const std::size_t v)
     {
-        for (const auto & dir : directives)
+        const auto & variant = variants[v];
+
+        // Variant defines go first, so they override the common -D ones.
+        PreprocessorOptions variantOptions = options;
+        variantOptions.predefines.insert(variantOptions.predefines.begin(),
+                                         variant.defines.begin(), variant.defines.end());
+        variantOptions.progNameSuffix = "_" + variant.name;
+        variantOptions.numThreads     = threadsPerVariant;
+
+        try
         {
-            for (const auto & def : dir.defines)
-            {
-                doReplaceDefs(line, def.name, def.value);
-            }
+            writePreprocessedFile(srcFile, outBaseName + "_" + variant.name + ".vsm", variantOptions, sourceCache);
         }
-        expandedDefs.emplace_back(std::move(line));
-    }
+        catch (std::exception & e)
+        {
+            std::cerr << "ERROR: Variant '" << variant.name << "' failed: " << e.what() << std::endl;
+            variantsFailed++;
+        }
+    });
 
-    return expandedDefs;
+    if (variantsFailed != 0)
+    {
+        throw std::runtime_error(std::to_string(variantsFailed) + " variant(s) failed.");
+    }
 }
 
 // ========================================================
-// doMacroExpansion():
+// runDriver():
 // ========================================================
 
-static void doMacroExpansion(std::string & line, const MacroBlock & macro)
+static std::string shellQuote(const std::string & s)
 {
-    if (macro.lines.empty())
+    // Single quotes, with any embedded ' written as '\''
+    std::string quoted{ "'" };
+    for (const char c : s)
     {
-        line.clear();
-        return;
+        if (c == '\'')
+        {
+            quoted += "'\\''";
+        }
+        else
+        {
+            quoted += c;
+        }
     }
+    quoted += "'";
+    return quoted;
+}
 
-    // Split the line by whitespace to get the macro params:
-    std::istringstream tokenizer{ line };
-    std::vector<std::string> params{ std::istream_iterator<std::string>{ tokenizer },
-                                     std::istream_iterator<std::string>{} };
+static std::string makeDownstreamCommand(const std::string & commandTemplate, const std::string & srcFile)
+{
+    // {in} is the source file, {out} the default .vsm name and {name} the source without extension.
+    const std::string baseName = removeFilenameExtension(srcFile);
+    const std::pair<const char *, std::string> placeholders[] = {
+        { "{in}",   shellQuote(srcFile)           },
+        { "{out}",  shellQuote(baseName + ".vsm") },
+        { "{name}", shellQuote(baseName)          },
+    };
 
-    // Do minimal parameter validation:
-    if (!macro.params.empty())
+    std::string command;
+    std::size_t pos = 0;
+    while (pos < commandTemplate.size())
     {
-        if ((params.size() - 2) != macro.params.size())
+        bool replaced = false;
+        for (auto && placeholder : placeholders)
         {
-            std::cerr << "ERROR: Macro '" << macro.name << "' takes "
-                      << macro.params.size() << " arguments, but "
-                      << (params.size() - 2) << " were provided!" << std::endl;
+            const std::size_t len = std::strlen(placeholder.first);
+            if (commandTemplate.compare(pos, len, placeholder.first) == 0)
+            {
+                command += placeholder.second;
+                pos += len;
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced)
+        {
+            command += commandTemplate[pos++];
+        }
+    }
+    return command;
+}
+
+static bool runDownstreamCommand(const std::string & command, const std::string & srcFile, const std::string & input)
+{
+    //
+    // Like popen(command, "w"), but the command gets SIGPIPE back to its default
+    // action. We ignore it while writing, and an ignored signal is inherited
+    // through exec, which would make tools like 'head' fail with EPIPE errors.
+    //
+    auto reportError = [&](const char * what)
+    {
+        std::cerr << "ERROR: Unable to run \"" << command << "\" for " << srcFile
+                  << ": " << what << ": " << std::strerror(errno) << std::endl;
+        return false;
+    };
+
+    // Other threads spawn commands too. Our end of the pipe has to be marked
+    // close-on-exec before any of them runs, or their command would keep it
+    // open and ours would never see the end of its input.
+    static std::mutex spawnMutex;
+    int pipeFds[2];
+    pid_t pid;
+    {
+        std::lock_guard<std::mutex> lock{ spawnMutex };
+
+        if (pipe(pipeFds) != 0)
+        {
+            return reportError("pipe");
+        }
+        fcntl(pipeFds[1], F_SETFD, FD_CLOEXEC);
+
+        posix_spawn_file_actions_t fileActions;
+        posix_spawn_file_actions_init(&fileActions);
+        posix_spawn_file_actions_adddup2(&fileActions, pipeFds[0], STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&fileActions, pipeFds[0]);
+
+        sigset_t defaultSignals;
+        sigemptyset(&defaultSignals);
+        sigaddset(&defaultSignals, SIGPIPE);
+
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setsigdefault(&attributes, &defaultSignals);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+        const char * args[] = { "sh", "-c", command.c_str(), nullptr };
+        const int spawnError = posix_spawn(&pid, "/bin/sh", &fileActions, &attributes,
+                                           const_cast<char * const *>(args), environ);
 
-            throw std::runtime_error("Not enough arguments in macro invocation.");
+        posix_spawnattr_destroy(&attributes);
+        posix_spawn_file_actions_destroy(&fileActions);
+        close(pipeFds[0]);
+
+        if (spawnError != 0)
+        {
+            close(pipeFds[1]);
+            errno = spawnError;
+            return reportError("posix_spawn");
         }
     }
-    else
+
+    // A short write just means the command exited without reading all of
+    // its input (we get EPIPE, since SIGPIPE is ignored); its exit status decides.
+    const char * data = input.data();
+    std::size_t remaining = input.size();
+    while (remaining != 0)
     {
-        if (params.size() > 2)
+        const auto written = write(pipeFds[1], data, remaining);
+        if (written < 0)
         {
-            std::cerr << "ERROR: Macro '" << macro.name << "' takes no arguments, but "
-                      << (params.size() - 2) << " were provided!" << std::endl;
-
-            throw std::runtime_error("Too many arguments in macro invocation.");
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
         }
+        data += written;
+        remaining -= static_cast<std::size_t>(written);
     }
+    close(pipeFds[1]);
 
-    // Replace the parameters, if any:
-    auto macroBody = macro.lines;
-    if (!macro.params.empty())
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0)
     {
-        auto stripCommas = [](std::string & s) -> std::string &
-        {
-            if (s.back()  == ',') { s.pop_back();    }
-            if (s.front() == ',') { s = s.substr(1); }
-            return s;
-        };
-
-        for (auto & l : macroBody)
+        if (errno != EINTR)
         {
-            for (std::size_t p = 0; p < macro.params.size(); ++p)
-            {
-                doReplaceDefs(l, macro.params[p], stripCommas(params[p + 1]));
-            }
+            return reportError("waitpid");
         }
     }
 
-    // Expand the macro body into the out:
-    line = "\n";
-    for (auto && l : macroBody)
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
     {
-        line += l;
-        line += "\n";
+        std::cerr << "ERROR: \"" << command << "\" failed for " << srcFile;
+        if (WIFEXITED(status))
+        {
+            std::cerr << " with exit code " << WEXITSTATUS(status);
+        }
+        std::cerr << std::endl;
+        return false;
     }
+    return true;
 }
 
-// ========================================================
-// resolveMacos():
-// ========================================================
-
-static std::vector<std::string> resolveMacos(const std::vector<std::string> & codeLines,
-                                             const std::vector<Directives>  & directives)
+static void runDriver(const std::string & commandTemplate, const std::vector<std::string> & srcFiles,
+                      const PreprocessorOptions & options)
 {
-    std::vector<std::string> expandedMacros;
+    //
+    // Preprocesses each source in turn and pipes the output straight into the
+    // stdin of a downstream command (normally the VCL scheduler), without any
+    // intermediate .vsm on disk. While the downstream commands run, the main
+    // thread is already preprocessing the next programs. At most options.maxJobs
+    // commands run at once; finished outputs wait in a queue until one is free.
+    //
+    struct Job
+    {
+        std::string srcFile;
+        std::string output;
+    };
 
-    // Same idea as in resolveDefines(): compare each line with each possible macro.
-    // NOTE: For simplicity, assume at most one macro invocation per line!
-    for (auto line : codeLines)
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    std::deque<Job> readyJobs;
+    bool allQueued = false;
+    std::atomic<int> programsFailed{ 0 };
+
+    // Commands that don't read all of their input shouldn't kill us.
+    // runDownstreamCommand() restores the default action for the commands.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    auto downstreamWorker = [&]()
     {
-        for (const auto & dir : directives)
+        for (;;)
         {
-            for (const auto & mc : dir.macros)
+            Job job;
             {
-                const auto pos = line.find(mc.name);
-                if (pos != std::string::npos && isMacroName(line, pos, mc.name.length()))
+                std::unique_lock<std::mutex> lock{ queueMutex };
+                queueCondition.wait(lock, [&]() { return !readyJobs.empty() || allQueued; });
+                if (readyJobs.empty())
                 {
-                    doMacroExpansion(line, mc);
-                    goto BREAKOUT; // Not related to the classic arcade game :P
+                    return;
                 }
+                job = std::move(readyJobs.front());
+                readyJobs.pop_front();
+            }
+
+            if (!runDownstreamCommand(makeDownstreamCommand(commandTemplate, job.srcFile), job.srcFile, job.output))
+            {
+                programsFailed++;
             }
         }
-    BREAKOUT:
-        expandedMacros.emplace_back(std::move(line));
+    };
+
+    const auto numWorkers = std::min<std::size_t>(std::max(1u, options.maxJobs), srcFiles.size());
+    std::vector<std::thread> workers;
+    for (std::size_t w = 0; w < numWorkers; ++w)
+    {
+        workers.emplace_back(downstreamWorker);
     }
 
-    return expandedMacros;
-}
+    // Programs often #include the same files, so share the loaded sources.
+    SourceCache sourceCache;
 
-// ========================================================
-// writeVcl[Prologue/Epilogue]:
-// ========================================================
+    for (auto && srcFile : srcFiles)
+    {
+        std::ostringstream outText;
+        try
+        {
+            runPreprocessor(srcFile, outText, options, sourceCache);
+        }
+        catch (std::exception & e)
+        {
+            std::cerr << "ERROR: Preprocessing " << srcFile << " failed: " << e.what() << std::endl;
+            programsFailed++;
+            continue;
+        }
 
-static void writeVclPrologue(std::ofstream & outFile)
-{
-    //
-    //outFile << ".init_vi_all\n";
-    //
-    // init_vi_all causes problems when using clipping
-    // instructions. The VU1 clipw and FC flag helpers
-    // require using register VI01 directly and OpenVCL
-    // doesn't seem to respect our uses of VI01 when
-    // init_vi_all is set, reusing it for other variables,
-    // which ends up causing the clip instructions to
-    // override other data. Explicitly specifying which
-    // registers OpenVCL can use fixes the problem by
-    // leaving VI01 out of the list. You'll get one less
-    // register to work with if you're not doing clipping,
-    // but the vast majority of programs will, and you
-    // still have 13 regs to play with, so this should
-    // be okay.
-    //
-    outFile << "\n";
-    outFile << ".init_vi VI02, VI03, VI04, VI05, VI06, VI07, VI08, VI09, VI10, VI11, VI12, VI13, VI14\n";
-    outFile << ".init_vf_all\n";
-    outFile << ".syntax new\n";
-    outFile << ".vu\n";
-    outFile << "\n";
-    outFile << "--enter\n";
-    outFile << "--endenter\n";
-    outFile << "\n";
-}
+        {
+            std::lock_guard<std::mutex> lock{ queueMutex };
+            readyJobs.push_back(Job{ srcFile, outText.str() });
+        }
+        queueCondition.notify_one();
+    }
 
-static void writeVclEpilogue(std::ofstream & outFile)
-{
-    outFile << "\n";
-    outFile << "--exit\n";
-    outFile << "--endexit\n";
-    outFile << "\n";
+    {
+        std::lock_guard<std::mutex> lock{ queueMutex };
+        allQueued = true;
+    }
+    queueCondition.notify_all();
+
+    for (auto && worker : workers)
+    {
+        worker.join();
+    }
+
+    if (programsFailed != 0)
+    {
+        throw std::runtime_error(std::to_string(programsFailed) + " of " + std::to_string(srcFiles.size()) + " program(s) failed.");
+    }
 }
 
 // ========================================================
-// stripComments():
+// parseDefineFlag():
 // ========================================================
 
-static void stripComments(std::string & s)
+static bool parseDefineFlag(const std::string & arg, std::vector<Definition> & predefines)
 {
-    // The only type of comment we handle is ';'
-    const auto pos = s.find_first_of(';');
-    if (pos == std::string::npos)
+    // NAME or NAME=VALUE
+    const auto equals = arg.find('=');
+    Definition def;
+    def.name  = arg.substr(0, equals);
+    def.value = (equals != std::string::npos) ? arg.substr(equals + 1) : "1";
+
+    if (def.name.empty() || !std::all_of(def.name.begin(), def.name.end(),
+                                         [](const char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }))
     {
-        return; // No comments in this line.
+        std::cerr << "Invalid command-line define \"" << arg << "\"!\n";
+        return false;
     }
-    // Remove everything after the comment start.
-    s.erase(pos, s.length());
+
+    predefines.emplace_back(std::move(def));
+    return true;
 }
 
 // ========================================================
-// runPreprocessor():
+// parseVariantFlag():
 // ========================================================
 
-static void runPreprocessor(std::string srcFile, std::string destFile,
-                            const bool addVclJunk, const bool fixCExpr)
+static bool parseVariantFlag(const std::string & arg, std::vector<Variant> & variants)
 {
-    // Source file is the root where substitutions take place.
-    Preprocessor srcPP{ std::move(srcFile), false };
-    auto srcDirectives = srcPP.parseDirectives();
+    // NAME:DEF1[=VAL],DEF2[=VAL],...
+    const auto colon = arg.find(':');
+    Variant variant;
+    variant.name = arg.substr(0, colon);
 
-    // Try to open the #included files:
-    int includesFailedToOpen = 0;
-    std::vector<std::unique_ptr<Preprocessor>> includePPs;
+    if (variant.name.empty() || !std::all_of(variant.name.begin(), variant.name.end(),
+                                             [](const char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }))
+    {
+        std::cerr << "Invalid variant name in \"" << arg << "\"! Expected 'name:DEF1[=VAL],DEF2...'\n";
+        return false;
+    }
 
-    for (auto && inc : srcDirectives.includes)
+    for (auto && other : variants)
     {
-        try
-        {
-            includePPs.emplace_back(std::make_unique<Preprocessor>(inc, true));
-        }
-        catch (...)
+        if (other.name == variant.name)
         {
-            // We want to log all the #includes that fail to open.
-            includesFailedToOpen++;
+            std::cerr << "Duplicate variant name \"" << variant.name << "\"!\n";
+            return false;
         }
     }
 
-    if (includesFailedToOpen != 0)
+    if (colon != std::string::npos)
     {
-        throw std::runtime_error("Failed to open include file(s).");
-    }
-
-    // Now we run the same preprocessing for each of the #includes,
-    // but if the included files have other includes we'll ignore them.
-    // There's no support for recursive includes right now.
-    std::vector<Directives> additionalDirectives;
-    additionalDirectives.reserve(includePPs.size());
+        std::istringstream defList{ arg.substr(colon + 1) };
+        std::string def;
 
-    for (auto && pp : includePPs)
-    {
-        auto && dir = pp->parseDirectives();
-        if (!dir.includes.empty())
+        while (std::getline(defList, def, ','))
         {
-            std::cerr << "ERROR: File " << pp->getCurrentFileName()
-                      << ": Include directives are not allowed inside #included files!"
-                      << std::endl;
-
-            throw std::runtime_error("Recursive includes.");
+            if (!def.empty() && !parseDefineFlag(def, variant.defines))
+            {
+                return false;
+            }
         }
-        additionalDirectives.emplace_back(dir);
     }
 
-    // We can release this memory now.
-    includePPs.clear();
-
-    // Now that the list of dependencies is resolved and we
-    // have all macros and defines, we can substitute in the
-    // source file.
-    const auto & srcCodeLines = srcPP.getCodeLines();
-
-    // Merge 'em:
-    additionalDirectives.emplace_back(std::move(srcDirectives));
-
-    // #macro expansion:
-    auto expandedMacros = resolveMacos(srcCodeLines, additionalDirectives);
+    variants.emplace_back(std::move(variant));
+    return true;
+}
 
-    // #define expansion and we are done:
-    auto finalProcessedText = resolveDefines(expandedMacros, additionalDirectives);
+// ========================================================
+// parseFlags():
+// ========================================================
 
-    //
-    // Finally, write the output file:
-    //
-    std::ofstream outFile{ destFile };
+static bool hasFlag(const char * test, const char * shortForm, const char * longForm)
+{
+    return std::strcmp(test, shortForm) == 0 ||
+           std::strcmp(test, longForm)  == 0;
+}
 
-    if (!outFile.is_open() || !outFile.good())
+static bool parseCountFlag(const int argc, const char * argv[], int & i, int & count, const char * what)
+{
+    const char * flag = argv[i];
+    count = (i + 1 < argc) ? std::atoi(argv[++i]) : 0;
+    if (count <= 0)
     {
-        std::cerr << "Unable to open file \"" << destFile << "\" for writing." << std::endl;
-        throw std::runtime_error("Can't open output file.");
+        std::cerr << "Invalid or missing " << what << " after \"" << flag << "\"!\n";
+        return false;
     }
+    return true;
+}
 
-    if (!srcPP.getVuProgName().empty())
+static bool parseFlags(const int argc, const char * argv[], const int firstArg, PreprocessorOptions & options,
+                       std::vector<Variant> & variants, std::vector<std::string> & otherArgs)
+{
+    // Anything that is not a flag or flag argument goes into otherArgs.
+    for (int i = firstArg; i < argc; ++i)
     {
-        outFile << "\n.name " << srcPP.getVuProgName() << "\n";
-    }
+        if (argv[i][0] != '-')
+        {
+            otherArgs.emplace_back(argv[i]);
+            continue;
+        }
 
-    if (addVclJunk)
-    {
-        writeVclPrologue(outFile);
-    }
+        if (hasFlag(argv[i], "-j", "--vcljunk"))  { options.addVclJunk   = true; }
+        if (hasFlag(argv[i], "-x", "--fixcexpr")) { options.fixCExpr     = true; }
+        if (hasFlag(argv[i], "-l", "--lazyinc"))  { options.lazyIncludes = true; }
+        if (hasFlag(argv[i], "-r", "--report"))   { options.printCodeSizeReport = true; }
+        if (hasFlag(argv[i], "-s", "--stats"))    { options.printStats = true; }
+        if (hasFlag(argv[i], "-i", "--incremental")) { options.incremental = true; }
 
-    for (auto && line : finalProcessedText)
-    {
-        stripComments(line);
-        if (!isBlank(line))
+        if (hasFlag(argv[i], "-t", "--threads"))
         {
-            if (fixCExpr)
+            int numThreads;
+            if (!parseCountFlag(argc, argv, i, numThreads, "thread count"))
             {
-                // Resolve exprs like 1+2 resulting from #define replacement.
-                fixupConstExpressions(line);
+                return false;
             }
-            outFile << line << "\n";
+            options.numThreads = static_cast<unsigned>(numThreads);
         }
-    }
 
-    if (addVclJunk)
-    {
-        writeVclEpilogue(outFile);
-    }
-}
+        if (hasFlag(argv[i], "-J", "--jobs"))
+        {
+            int maxJobs;
+            if (!parseCountFlag(argc, argv, i, maxJobs, "job count"))
+            {
+                return false;
+            }
+            options.maxJobs = static_cast<unsigned>(maxJobs);
+        }
 
-// ========================================================
-// removeFilenameExtension():
-// ========================================================
+        if (hasFlag(argv[i], "-m", "--max-instructions"))
+        {
+            if (!parseCountFlag(argc, argv, i, options.maxInstructions, "instruction count"))
+            {
+                return false;
+            }
+        }
 
-static std::string removeFilenameExtension(const std::string & filename)
-{
-	const auto lastDot = filename.find_last_of('.');
-	if (lastDot == std::string::npos)
-	{
-		return filename;
-	}
-	return filename.substr(0, lastDot);
+        if (hasFlag(argv[i], "-V", "--variant"))
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "Missing variant after \"" << argv[i] << "\"!\n";
+                return false;
+            }
+            if (!parseVariantFlag(argv[++i], variants))
+            {
+                return false;
+            }
+        }
+
+        if (std::strncmp(argv[i], "-D", 2) == 0)
+        {
+            // Either -DNAME=VALUE or -D NAME=VALUE
+            const char * def = argv[i] + 2;
+            if (*def == '\0' && i + 1 < argc)
+            {
+                def = argv[++i];
+            }
+            if (!parseDefineFlag(def, options.predefines))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
 // ========================================================
@@ -849,10 +4337,32 @@ static void printHelpText(const char * progName)
         << " Applies custom preprocessing to a source file prior to running VCL.\n"
         << " This preprocessor supports C-style #define constants and custom #macro directives.\n"
         << " If no output filename is provided the input name is used but the extension is replaced with '.vsm'\n"
+        << "\n"
+        << " $ " << progName << " -d <command> <input-files...> [options]\n"
+        << " Driver mode: preprocesses each input and pipes the output into the stdin of <command>, which\n"
+        << " usually runs VCL. {in}, {out} and {name} in the command are replaced with the input file,\n"
+        << " the '.vsm' name and the input name without extension. The next input is preprocessed while\n"
+        << " the commands run. No '.vsm' files are written.\n"
+        << "\n"
         << " Options are:\n"
         << "  -h, --help     Prints this message and exits.\n"
         << "  -j, --vcljunk  Adds the standard VCL prologue/epilogue junk to the output.\n"
-        << "  -x, --fixcexpr Tries to resolve constant expressions involving literals, like 1+2.\n"
+        << "  -x, --fixcexpr Folds constant expressions involving literals, like (1+2)*4 or 0.5*2.0.\n"
+        << "  -l, --lazyinc  Only parses the #defines and #macros from #include files that are actually used.\n"
+        << "  -D<name>[=val] Defines a constant, like a #define in the source. Value defaults to 1. Can be repeated.\n"
+        << "  -V, --variant <name>:<def>[=val],...\n"
+        << "                 Adds a variant with its own set of defines. Writes one '<output>_<name>.vsm' per variant,\n"
+        << "                 with the program renamed to '<vuprog>_<name>'. Can be repeated.\n"
+        << "  -r, --report   Prints the number of output instructions coming from each macro and call site.\n"
+        << "  -m, --max-instructions <n>\n"
+        << "                 Fails (and deletes the output) if the program has more than n instructions.\n"
+        << "  -s, --stats    Prints macro expansion cache hits/misses.\n"
+        << "  -i, --incremental\n"
+        << "                 Keeps an index of the #defines/#macros used by each line in '<output>.ppi' and on the\n"
+        << "                 next run only expands again the lines affected by what changed.\n"
+        << "  -t, --threads <n>\n"
+        << "                 Threads used for large sources and variants. Defaults to the number of CPU cores.\n"
+        << "  -J, --jobs <n> Driver mode: max commands running at once. Defaults to the number of CPU cores.\n"
         << "\n"
         << "Created by Guilherme R. Lampert, " << __DATE__ << ".\n";
 }
@@ -878,6 +4388,48 @@ int main(int argc, const char * argv[])
         }
     }
 
+    PreprocessorOptions options;
+    std::vector<Variant> variants;
+    std::vector<std::string> otherArgs;
+    options.numThreads = std::max(1u, std::thread::hardware_concurrency());
+    options.maxJobs    = options.numThreads;
+
+    // Driver mode: vclpp -d <command> <input-files...> [options]
+    if (hasFlag(argv[1], "-d", "--drive"))
+    {
+        if (argc < 3 || argv[2][0] == '\0')
+        {
+            std::cerr << "Missing command after \"" << argv[1] << "\"!\n";
+            return EXIT_FAILURE;
+        }
+        if (!parseFlags(argc, argv, 3, options, variants, otherArgs))
+        {
+            return EXIT_FAILURE;
+        }
+        if (otherArgs.empty())
+        {
+            std::cerr << "No input files given for \"" << argv[1] << "\"!\n";
+            return EXIT_FAILURE;
+        }
+        if (!variants.empty() || options.incremental)
+        {
+            std::cerr << "Variants and incremental mode are not supported in driver mode!\n";
+            return EXIT_FAILURE;
+        }
+
+        try
+        {
+            runDriver(argv[2], otherArgs, options);
+            return EXIT_SUCCESS;
+        }
+        catch (std::exception & e)
+        {
+            std::cerr << "Unhandled exception: " << e.what() << std::endl;
+            std::cerr << "Terminating due to previous error(s)..." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
     const std::string inFileName{ argv[1] };
 
     // Check for a flag in the wrong place/empty string...
@@ -887,6 +4439,12 @@ int main(int argc, const char * argv[])
         return EXIT_FAILURE;
     }
 
+    // Additional flags:
+    if (!parseFlags(argc, argv, 2, options, variants, otherArgs))
+    {
+        return EXIT_FAILURE;
+    }
+
     std::string outFileName;
     if (argc >= 3 && argv[2][0] != '-') // Output name provided?
     {
@@ -897,30 +4455,17 @@ int main(int argc, const char * argv[])
         outFileName = removeFilenameExtension(inFileName) + ".vsm";
     }
 
-    // Additional flags:
-    bool addVclJunk = false;
-    bool fixCExpr   = false;
-
-    if (argc >= 3)
+    try
     {
-        auto hasFlag = [](const char * test, const char * shortForm, const char * longForm)
+        if (!variants.empty())
         {
-            return std::strcmp(test, shortForm) == 0 ||
-                   std::strcmp(test, longForm)  == 0;
-        };
-        for (int i = 2; i < argc; ++i)
+            runVariants(inFileName, outFileName, options, variants);
+        }
+        else
         {
-            if (argv[i][0] == '-')
-            {
-                if (hasFlag(argv[i], "-j", "--vcljunk"))  { addVclJunk = true; }
-                if (hasFlag(argv[i], "-x", "--fixcexpr")) { fixCExpr   = true; }
-            }
+            SourceCache sourceCache;
+            writePreprocessedFile(inFileName, outFileName, options, sourceCache);
         }
-    }
-
-    try
-    {
-        runPreprocessor(inFileName, outFileName, addVclJunk, fixCExpr);
         return EXIT_SUCCESS;
     }
     catch (std::exception & e)